@@ -9,6 +9,32 @@
  * use fflush, or things will go awry */
 //#define NO_STDIO
 
+/* tickless idle: when no task is due, SysTick is stretched to the next deadline instead of waking the
+ * core HZ times per second (jiffies is caught up on wakeup). The breathing LED w/o BREATHING_LED_DMA
+ * needs a timer callback LED_WAVE_RATE times per second though. */
+#define TICKLESS_IDLE
+
+/* clock governor: the core drops to 12MHz after 1s without USB traffic or a running command
+ * (USB keeps its 48MHz clock) */
+#define CLOCK_GOVERNOR
+
+/* PC-sampling profiler on TIM16 ("prof" command, see common-code/profiler.h) */
+#define PROFILER
+
+/* run the ISR hot paths (SysTick, USB callbacks) from SRAM instead of flash with its wait states, and on
+ * STM32C0 also the vector table (via VTOR). the "usbisr" command shows the resulting USB ISR runtime */
+#define RAM_HOT_PATHS
+#define RAM_VECTORS
+
+/* paint the stacks at boot for the high-water marks shown by the "mem" command. interrupts get their own
+ * stack of ISR_STACK_SIZE bytes (MSP), which is taken from the RAM left to the main stack */
+#define STACK_WATERMARK
+#define ISR_STACK_SIZE			512
+
+/* interrupt latency/duration histograms and masked-IRQ stretches on TIM3 ("irqs" command, see
+ * common-code/irqtrace.h) - enables the 1kHz USB SOF interrupt to measure the USB latency */
+//#define IRQ_TRACE
+
 /* you can enable a heartbeat LED here - only active in main loop */
 
 #define HEARTBEAT_RCC 			RCC_GPIOB
@@ -17,6 +43,7 @@
 #if defined(STM32C0)
 #define HEARTBEAT_LED_PIN		GPIO2	/* cyan */
 #define BREATHING_LED
+#define BREATHING_LED_DMA	/* LED pattern played back by TIM17 + DMA instead of a timer callback */
 
 #define BOOT0_RCC				RCC_GPIOA
 #define BOOT0_PORT				GPIOA
@@ -1,10 +1,16 @@
 #include "platform.h"
 #include "console.h"
+#include "sched.h"
+#include "softtimer.h"
+#ifdef PROFILER
+#include "profiler.h"
+#endif
 
 #include <string.h>
 
+#include <libopencm3/stm32/rcc.h>
+
 // for mem dump
-#include <stdlib.h>
 #include "utils.h"
 
 #ifndef NO_STDIO
@@ -13,9 +19,9 @@
 #else
 #define fflush(a)
 #define stdout
-#define write(fd,p,n)   ACM_tx((p), (n), 1)
-#define fputs(str,fh)   ACM_tx((str), strlen(str), 1)
-#define puts(str)       do{ ACM_tx((str), strlen(str), 1); ACM_tx("\n", 1, 1); } while(0)
+#define write(fd,p,n)   ACM_stdout((p), (n))
+#define fputs(str,fh)   ACM_stdout((str), strlen(str))
+#define puts(str)       do{ ACM_stdout((str), strlen(str)); ACM_stdout("\n", 1); } while(0)
 #endif // defined(NO_STDIO)
 
 // see config.h
@@ -24,23 +30,22 @@
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/gpio.h>
 
+static void heartbeat(soft_timer_t *timer) {
+	(void)timer;
+	gpio_toggle(HEARTBEAT_LED_PORT, HEARTBEAT_LED_PIN);
+}
+
+static soft_timer_t heartbeat_timer = { .callback = heartbeat, .period = HZ/2 };
+
 static void heartbeat_init(void) {
 	rcc_periph_clock_enable(HEARTBEAT_RCC);
 	gpio_set_output_options(HEARTBEAT_LED_PORT, GPIO_OTYPE_PP, GPIO_OSPEED_LOW, HEARTBEAT_LED_PIN);
 	gpio_mode_setup(HEARTBEAT_LED_PORT, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, HEARTBEAT_LED_PIN);
-}
-
-static void heartbeat(uint32_t now) {
-	static timeout_t t = { .expired = 1 };
-	if(timeout_check(&t,now)) {
-		gpio_toggle(HEARTBEAT_LED_PORT, HEARTBEAT_LED_PIN);
-		timeout_set(&t, HZ/2);
-	}
+	soft_timer_start(&heartbeat_timer, 0);
 }
 
 #else
 static void heartbeat_init(void)	{}
-static void heartbeat(uint32_t now)	{now=now;}
 #endif
 
 #if defined(BREATHING_LED)
@@ -51,8 +56,132 @@ static void heartbeat(uint32_t now)	{now=now;}
 #define PWM_FREQUENCY	500
 #define PWM_MAXVAL		(4096-1)
 
+/* the LED pattern is a table of TIM14 compare values played back in a loop at LED_WAVE_RATE */
+#define LED_WAVE_RATE	50
+#define LED_WAVE_MAX	(4 * LED_WAVE_RATE)
+
+enum led_pattern { LED_OFF, LED_ON, LED_BREATHE, LED_BUSY, LED_ERROR };
+static const char * const led_pattern_names[] = { "off", "on", "breathe", "busy", "error", NULL };
+
+static uint16_t led_wave[LED_WAVE_MAX];
+static uint32_t led_wave_len;
+
+/* triangle with a plateau at the top, squared for a perceptually linear fade */
+static uint32_t wave_breathe(uint32_t period_ms) {
+	uint32_t i, n = MIN((period_ms * LED_WAVE_RATE) / 1000, LED_WAVE_MAX);
+	for(i=0; i<n; i++) {
+		uint32_t level = ((MIN(i, n - i) * 2 * (PWM_MAXVAL + 1 + 1024)) / n);
+		level = MIN(level, PWM_MAXVAL);
+		led_wave[i] = (level * level) >> 12;
+	}
+	return n;
+}
+
+static uint32_t wave_blink(uint32_t period_ms) {
+	uint32_t i, n = MIN((period_ms * LED_WAVE_RATE) / 1000, LED_WAVE_MAX);
+	for(i=0; i<n; i++)
+		led_wave[i] = (i < (n / 2)) ? PWM_MAXVAL : 0;
+	return n;
+}
+
+static uint32_t wave_level(uint16_t level) {
+	led_wave[0] = level;
+	return 1;
+}
+
+#ifdef BREATHING_LED_DMA
+#include <libopencm3/stm32/dma.h>
+
+/* TIM17 paces the DMA, which copies the table into TIM14's compare register - no CPU involved */
+#define LED_DMA_CHANNEL		DMA_CHANNEL1	/* TIM17_UP on the F0 (w/o remap), any channel via DMAMUX on the C0 */
+#if defined(STM32C0)
+#include <libopencm3/stm32/dmamux.h>
+#define LED_DMA_RCC			RCC_DMA1
+#ifndef LED_DMAREQ_TIM17_UP
+#define LED_DMAREQ_TIM17_UP	27			/* DMAMUX request input of TIM17_UP, see the reference manual */
+#endif
+#else
+#define LED_DMA_RCC			RCC_DMA
+#endif
+
+static void led_wave_start(void) {
+	dma_disable_channel(DMA1, LED_DMA_CHANNEL);
+	dma_set_memory_address(DMA1, LED_DMA_CHANNEL, (uint32_t)led_wave);
+	dma_set_number_of_data(DMA1, LED_DMA_CHANNEL, led_wave_len);
+	dma_enable_channel(DMA1, LED_DMA_CHANNEL);
+}
+
+/* 10kHz counter clock, one update per table entry */
+static void led_pacer_set_prescaler(void) {
+	timer_set_prescaler(TIM17, (rcc_apb1_frequency / 10000) - 1);
+}
+
+static void led_wave_init(void) {
+	rcc_periph_clock_enable(LED_DMA_RCC);
+	rcc_periph_clock_enable(RCC_TIM17);
+	rcc_periph_reset_pulse(RST_TIM17);
+
+	dma_channel_reset(DMA1, LED_DMA_CHANNEL);
+	dma_set_peripheral_address(DMA1, LED_DMA_CHANNEL, (uint32_t)&TIM_CCR1(TIM14));
+	dma_set_read_from_memory(DMA1, LED_DMA_CHANNEL);
+	dma_enable_memory_increment_mode(DMA1, LED_DMA_CHANNEL);
+	dma_set_peripheral_size(DMA1, LED_DMA_CHANNEL, DMA_CCR_PSIZE_16BIT);
+	dma_set_memory_size(DMA1, LED_DMA_CHANNEL, DMA_CCR_MSIZE_16BIT);
+	dma_enable_circular_mode(DMA1, LED_DMA_CHANNEL);
+#if defined(STM32C0)
+	dmamux_set_dma_channel_request(DMAMUX1, LED_DMA_CHANNEL, LED_DMAREQ_TIM17_UP);
+#endif
+
+	led_pacer_set_prescaler();
+	timer_set_period(TIM17, (10000 / LED_WAVE_RATE) - 1);
+	timer_enable_irq(TIM17, TIM_DIER_UDE);
+	timer_enable_counter(TIM17);
+}
+#else
+/* software playback on a soft timer */
+static void led_wave_step(soft_timer_t *timer) {
+	static uint32_t idx;
+	(void)timer;
+	idx = (idx + 1 < led_wave_len) ? (idx + 1) : 0;
+	timer_set_oc_value(TIM14, TIM_OC1, led_wave[idx]);
+}
+
+static soft_timer_t led_wave_timer = { .callback = led_wave_step, .period = HZ / LED_WAVE_RATE };
+
+static void led_wave_start(void) {
+	if(led_wave_len > 1)
+		soft_timer_start(&led_wave_timer, 0);
+	else {
+		soft_timer_stop(&led_wave_timer);
+		timer_set_oc_value(TIM14, TIM_OC1, led_wave[0]);
+	}
+}
+
+static void led_pacer_set_prescaler(void)	{}
+static void led_wave_init(void)				{}
+#endif /* BREATHING_LED_DMA */
+
+/* switches the LED pattern, e.g. to signal busy or error states */
+static void pwmled_set_pattern(enum led_pattern pattern) {
+	switch(pattern) {
+	case LED_OFF:   led_wave_len = wave_level(0);			break;
+	case LED_ON:    led_wave_len = wave_level(PWM_MAXVAL);	break;
+	case LED_BUSY:  led_wave_len = wave_breathe(1000);		break;
+	case LED_ERROR: led_wave_len = wave_blink(200);			break;
+	default:        led_wave_len = wave_breathe(3200);		break;
+	}
+	led_wave_start();
+}
+
+/* TIM14 (and TIM17) run from APB1, which follows the clock governor */
+static void pwmled_set_prescaler(void) {
+	timer_set_prescaler(TIM14, (rcc_apb1_frequency / (PWM_FREQUENCY * (PWM_MAXVAL+1))) - 1);
+	led_pacer_set_prescaler();
+}
+
+static clock_notifier_t pwmled_clock_notifier = { .changed = pwmled_set_prescaler };
+
 static void pwmled_init(void) {
-    uint32_t prescaler = (rcc_apb1_frequency / (PWM_FREQUENCY * (PWM_MAXVAL+1))) - 1;
 
 	gpio_set_output_options(GPIOB, GPIO_OTYPE_PP, GPIO_OSPEED_LOW, GPIO1);
 	gpio_mode_setup(GPIOB, GPIO_MODE_AF, GPIO_PUPD_NONE, GPIO1);
@@ -61,7 +190,8 @@ static void pwmled_init(void) {
 	rcc_periph_clock_enable(RCC_TIM14);
 	rcc_periph_reset_pulse(RST_TIM14);
 
-	timer_set_prescaler(TIM14, prescaler); // Set prescaler
+	pwmled_set_prescaler();
+	clock_notifier_add(&pwmled_clock_notifier);
 	timer_set_period(TIM14, PWM_MAXVAL); // Set auto-reload register
 
 	//timer_disable_oc_output(TIM14, TIM_OC1);
@@ -71,21 +201,38 @@ static void pwmled_init(void) {
 	timer_set_oc_value(TIM14, TIM_OC1, 0);
 	timer_enable_oc_output(TIM14, TIM_OC1);
 	timer_enable_counter(TIM14);
+
+	led_wave_init();
+	pwmled_set_pattern(LED_BREATHE);
 }
 
-static void breathe(void) {
-	static uint32_t brightness=0, inc=-32;
-	uint32_t pwm;
-	if((!brightness) || (brightness == (4096+1024)))
-		inc=-inc;
-	brightness+=inc;
-	pwm = MIN(brightness, 4095);
-	pwm *= pwm;
-	pwm>>=12;
-	timer_set_oc_value(TIM14, TIM_OC1, pwm);
+CONSOLE_COMMAND_DEF(led, "set the LED pattern",
+	CONSOLE_ENUM_ARG_DEF(pattern, led_pattern_names, "off|on|breathe|busy|error")
+);
+static void led_command_handler(const led_args_t* args) {
+	pwmled_set_pattern((enum led_pattern)args->pattern);
 }
 #endif
 
+#if defined(BOOT0_PIN) && defined(BOOT0_PORT)
+/* holding BOOT0 high for 2s resets the MCU - polled every 100ms, so an idle core can stay asleep */
+#define BOOT0_POLL_TICKS	(HZ/10)
+static void boot0_check(soft_timer_t *timer) {
+	static uint32_t boot0_trigger = 0;
+	(void)timer;
+	if(gpio_get(BOOT0_PORT, BOOT0_PIN)) {
+		if(++boot0_trigger == ((HZ<<1) / BOOT0_POLL_TICKS)) {
+			SCB_AIRCR = SCB_AIRCR_VECTKEY | SCB_AIRCR_SYSRESETREQ; /* trigger system reset via SCB */
+			while(1) {}
+		}
+	}
+	else
+		boot0_trigger = 0;
+}
+
+static soft_timer_t boot0_timer = { .callback = boot0_check, .period = BOOT0_POLL_TICKS };
+#endif /* BOOT0 */
+
 /* these are some example console commands
  *
  * make sure to have a look at common-code/console_config.h to verify the console settings */
@@ -96,13 +243,12 @@ static void ver_command_handler(void) {
 }
 
 CONSOLE_COMMAND_DEF(md, "memory dump (32Bit words)",
-	CONSOLE_STR_ARG_DEF(addr, "hex address"),
-	CONSOLE_OPTIONAL_INT_ARG_DEF(n, "n_words")
+	CONSOLE_HEX_ARG_DEF(addr, "address"),
+	CONSOLE_OPTIONAL_UINT_ARG_DEF(n, "n_words")
 );
 static void md_command_handler(const md_args_t* args) {
-	uint32_t addr = strtoul(args->addr, NULL, 16);
-	volatile uint32_t *src = (volatile uint32_t *)(addr & (~3));
-	uint32_t i, n = (args->n >= 1) ? args->n : 8;
+	volatile uint32_t *src = (volatile uint32_t *)(args->addr & (~3));
+	uint32_t i, n = ((args->n != CONSOLE_UINT_ARG_DEFAULT) && (args->n >= 1)) ? args->n : 8;
 	char buf[16];
 	for(i=0;i<n;i++,src++) {
 		/* print addr */
@@ -124,42 +270,61 @@ static void md_command_handler(const md_args_t* args) {
 
 CONSOLE_COMMAND_DEF(erase_vt, "erase flash page 0 to reenable DFU bootloader");
 static void erase_vt_command_handler(void) {
-	const char *yes = "yes\n";
-	fputs("WARNING! This will erase a part of the firmware (flash page 0) to reenable\n"
-	"the BootROM DFU bootloader. The firmware will no longer work after this!\n"
-	"A powercycle may be needed to access the bootloader.\n"
-	"Continue? (Enter yes): ", stdout);
-	fflush(stdout);
-	ACM_waitfor_txdone();
-	for(SIGINT=0;*yes;yes++) {
-		int v = ACM_readbyte();
-		if((*yes ^ v) || SIGINT)
-			goto abort;
-		write(1,&v,1);
-	}
-	if((!(*yes)) && (!SIGINT)) {
+	static const char *yes;
+	uint8_t v;
+	switch(console_get_step()) {
+	case CONSOLE_STEP_START:
+		fputs("WARNING! This will erase a part of the firmware (flash page 0) to reenable\n"
+		"the BootROM DFU bootloader. The firmware will no longer work after this!\n"
+		"A powercycle may be needed to access the bootloader.\n"
+		"Continue? (Enter yes): ", stdout);
+		yes = "yes\n";
+		/* the answer comes through the console, the main loop keeps running meanwhile (Ctrl+C cancels) */
+		console_yield_for_input();
+		return;
+	case CONSOLE_STEP_RESUME:
+		for(;*yes && console_read_input(&v, 1);yes++) {
+			if(*yes ^ v)
+				goto abort;
+			write(1,&v,1);
+		}
+		if(*yes) {
+			console_yield_for_input();
+			return;
+		}
 		puts("Erasing page 0 - USB will disconnect now.");
 		fflush(stdout);
 		ACM_waitfor_txdone();
 		usb_shutdown();
 		erase_page0(0xAA55);
+		return;
+	case CONSOLE_STEP_CANCEL:
+		break;
 	}
-	return;
 abort:
 	puts("\nuser abort");
+	console_set_status(1);
 }
 
-CONSOLE_COMMAND_DEF(anim, "nonsense command to demonstrate SIGINT & WFI sleeping");
+CONSOLE_COMMAND_DEF(anim, "nonsense command to demonstrate a resumable command - the main loop keeps running");
 static void anim_command_handler(void) {
 	const char seq[] = "\r.\ro\rO\ro";
-	int idx=0;
-	puts("demo loop - abort with Ctrl+C");
-	// SIGINT is set in USB rx handler ISR - must be cleared by user
-	for(SIGINT=0;!SIGINT;idx+=2) {
+	static int idx;
+	switch(console_get_step()) {
+	case CONSOLE_STEP_START:
+		puts("demo loop - abort with Ctrl+C");
+		idx = 0;
+		/* fall through */
+	case CONSOLE_STEP_RESUME:
+		/* instead of sleeping, return and get called again from the main loop in 100ms (Ctrl+C cancels) */
 		write(1,seq+(idx&7),2);
-		sleep_ms(100); // this will not abort on SIGINT - use SLEEP_UNTIL(timeout_check(...) || SIGINT) for interruptible sleeping
+		idx+=2;
+		console_yield_for(100);
+		break;
+	case CONSOLE_STEP_CANCEL:
+		puts("");
+		break;
 	}
-	puts("");
 }
 
 /* example command with arguments */
@@ -175,17 +340,326 @@ static void echo_command_handler(const echo_args_t* args) {
 	puts(args->str ? args->str : "(NULL)");
 }
 
+/* example command with a streamed argument - the data may be longer than a console line */
+CONSOLE_COMMAND_DEF(count, "example command - counts & sums up the bytes of streamed data (ends with the line)",
+	CONSOLE_STREAM_ARG_DEF(data, "any data")
+);
+static void count_command_handler(const count_args_t* args) {
+	static uint32_t bytes, sum;
+	const console_stream_t *stream = args->data;
+	char buf[12];
+	uint32_t i;
+	switch(stream->event) {
+	case CONSOLE_STREAM_START:
+		bytes = sum = 0;
+		break;
+	case CONSOLE_STREAM_DATA:
+		bytes += stream->length;
+		for(i=0;i<stream->length;i++)
+			sum += stream->data[i];
+		break;
+	case CONSOLE_STREAM_END:
+		i32_to_dec(bytes, buf, 11, -1, 0);
+		fputs(buf, stdout);
+		fputs(" bytes, sum: ", stdout);
+		u32_to_hex(sum, buf);
+		puts(buf);
+		break;
+	case CONSOLE_STREAM_ABORT:
+		puts("aborted");
+		console_set_status(1);
+		break;
+	}
+}
+
+/* right-aligned decimal column - i32_to_dec() pads buf, but returns the first digit */
+static void put_dec(int32_t val, unsigned int width) {
+	char buf[12];
+	i32_to_dec(val, buf, width, -1, 0);
+	fputs(buf, stdout);
+}
+
+CONSOLE_COMMAND_DEF(tasks, "show the scheduler's tasks with their runs, total & max runtime");
+static void tasks_command_handler(void) {
+	const uint32_t cycles_per_ms = CORE_CLOCK_HZ / 1000;
+	task_t *t;
+	puts("      runs   total ms     max us  task");
+	for(t=sched_tasks(); t; t=t->next) {
+		put_dec(t->runs, 10);
+		put_dec((uint32_t)(t->cycles_total / cycles_per_ms), 11);
+		put_dec(t->cycles_max / (cycles_per_ms / 1000), 11);
+		fputs("  ", stdout);
+		puts(t->name);
+	}
+}
+
+CONSOLE_COMMAND_DEF(usbisr, "show & reset the longest USB ISR runtime");
+static void usbisr_command_handler(void) {
+	uint32_t max = usb_isr_max_cycles(1);
+	char buf[12];
+	fputs("usb_isr max: ", stdout);
+	fputs(i32_to_dec(max, buf, 10, -1, 0), stdout);
+	fputs(" cycles, ", stdout);
+	fputs(i32_to_dec(max / (CORE_CLOCK_HZ / 1000000), buf, 10, -1, 0), stdout);
+#ifdef RAM_HOT_PATHS
+	puts(" us (hot paths in SRAM)");
+#else
+	puts(" us (hot paths in flash)");
+#endif
+}
+
+/* console instance on the USB ACM port - further instances (e.g. on a UART) share the registered commands */
+static console_t acm_console;
+
+static void mem_usage_print(const char *name, const mem_usage_t *u) {
+	put_dec(u->peak, 10);
+	put_dec(u->size, 10);
+	put_dec(u->size ? ((u->peak * 100) / u->size) : 0, 5);
+	fputs("%  ", stdout);
+	puts(name);
+}
+
+CONSOLE_COMMAND_DEF(mem, "show the peak usage of the stacks and buffers");
+static void mem_command_handler(void) {
+	mem_usage_t rx, tx, line;
+	puts("      peak      size  used  what");
+#ifdef STACK_WATERMARK
+	{
+		mem_usage_t main_stack, isr_stack;
+		stack_usage(&main_stack, &isr_stack);
+		mem_usage_print("main stack", &main_stack);
+		mem_usage_print("ISR stack", &isr_stack);
+	}
+#endif
+	ACM_buf_usage(&rx, &tx);
+	mem_usage_print("ACM rx buffer", &rx);
+	mem_usage_print("ACM tx buffer", &tx);
+	line.peak = console_line_peak(&acm_console);
+	line.size = CONSOLE_MAX_LINE_LENGTH - 1;
+	mem_usage_print("console line", &line);
+}
+
+#ifdef IRQ_TRACE
+static const char * const irqs_actions[] = { "clear", NULL };
+
+/* trace ticks as us with one decimal */
+static void put_trace_us(uint16_t ticks) {
+	char buf[12];
+	i32_to_dec((ticks * 10) / IRQ_TRACE_US(1), buf, 8, 1, 0);
+	fputs(buf, stdout);
+}
+
+static void irq_hist_print(const char *name, uint32_t n, uint16_t max, const uint32_t *hist) {
+	uint32_t i;
+	fputs(name, stdout);
+	put_dec(n, 10);
+	put_trace_us(max);
+	for(i=0; i<IRQ_TRACE_BUCKETS; i++)
+		put_dec(hist[i], 6);
+	puts("");
+}
+
+CONSOLE_COMMAND_DEF(irqs, "show (or clear) the ISR latency & duration histograms and the longest masked-IRQ stretches",
+	CONSOLE_OPTIONAL_ENUM_ARG_DEF(action, irqs_actions, "clear")
+);
+static void irqs_command_handler(const irqs_args_t* args) {
+	static const char * const irq_names[IRQ_TRACE_IRQS] = { "usb    ", "systick" };
+	static const char * const mask_names[IRQ_MASK_SITES] = { "idle       ", "clock      ", "ACM_tx     ", "ACM_rx_free" };
+	irq_trace_stats_t stats[IRQ_TRACE_IRQS];
+	irq_mask_stats_t masks[IRQ_MASK_SITES];
+	uint32_t i;
+
+	if(args->action != CONSOLE_INT_ARG_DEFAULT) {
+		irq_trace_clear();
+		return;
+	}
+	irq_trace_get(stats, masks);
+	puts("                count  max us    <1    <2    <4    <8   <16   <32   <64  >=64 us");
+	for(i=0; i<IRQ_TRACE_IRQS; i++) {
+		fputs(irq_names[i], stdout);
+		irq_hist_print(" lat", stats[i].latency_count, stats[i].latency_max, stats[i].latency);
+		fputs(irq_names[i], stdout);
+		irq_hist_print(" dur", stats[i].count, stats[i].duration_max, stats[i].duration);
+	}
+	puts("masked IRQs     count  max us");
+	for(i=0; i<IRQ_MASK_SITES; i++) {
+		fputs(mask_names[i], stdout);
+		put_dec(masks[i].count, 10);
+		put_trace_us(masks[i].max);
+		puts("");
+	}
+}
+#endif
+
+#ifdef PROFILER
+enum prof_action { PROF_START, PROF_STOP, PROF_CLEAR, PROF_TOP, PROF_STREAM };
+static const char * const prof_actions[] = { "start", "stop", "clear", "top", "stream", NULL };
+
+CONSOLE_COMMAND_DEF(prof, "PC-sampling profiler - top shows the hottest code, stream the raw PCs (until Ctrl+C)",
+	CONSOLE_ENUM_ARG_DEF(action, prof_actions, "start|stop|clear|top|stream"),
+	CONSOLE_OPTIONAL_UINT_ARG_DEF(n, "entries shown by top")
+);
+static void prof_command_handler(const prof_args_t* args) {
+	profiler_entry_t top[16];
+	uint32_t i, n, total, dropped, pc;
+	char buf[12];
+	switch(args->action) {
+	case PROF_START:
+		profiler_start();
+		break;
+	case PROF_STOP:
+		profiler_stop();
+		break;
+	case PROF_CLEAR:
+		profiler_clear();
+		break;
+	case PROF_TOP:
+		/* address, samples, permille - feed this into profiler_symbols.py */
+		total = profiler_samples(&dropped);
+		n = (args->n != CONSOLE_UINT_ARG_DEFAULT) ? MIN(args->n, 16) : 16;
+		n = profiler_top(top, n);
+		for(i=0; i<n; i++) {
+			u32_to_hex(top[i].addr, buf);
+			fputs(buf, stdout);
+			put_dec(top[i].count, 10);
+			put_dec(total ? ((top[i].count * 1000) / total) : 0, 6);
+			puts("");
+		}
+		fputs("samples ", stdout);
+		fputs(i32_to_dec(total, buf, 10, -1, 0), stdout);
+		fputs(" dropped ", stdout);
+		puts(i32_to_dec(dropped, buf, 10, -1, 0));
+		break;
+	case PROF_STREAM:
+		/* resumable like anim: one PC per line, drained every 100ms from the main loop until Ctrl+C */
+		if(console_get_step() == CONSOLE_STEP_CANCEL)
+			break;
+		while(profiler_read(&pc)) {
+			u32_to_hex(pc, buf);
+			puts(buf);
+		}
+		console_yield_for(100);
+		break;
+	}
+}
+#endif
+
 /* list of console commands */
 static const console_command_def_t * const console_commands[] = {
-	ver, md, erase_vt, anim, echo, NULL
+	ver, md, erase_vt, anim, echo, count, tasks, usbisr, mem,
+#ifdef BREATHING_LED
+	led,
+#endif
+#ifdef PROFILER
+	prof,
+#endif
+#ifdef IRQ_TRACE
+	irqs,
+#endif
+	NULL
 };
 
 /* write function for console */
 static void console_write(const char *s) {
 	int len=strlen(s);
+	fflush(stdout); /* keep handler output (stdio) and console output (e.g. machine mode frames) in order */
 	write(1,s,len);
 }
 
+/* binary write function for console (RPC replies) - no \n translation, must not drop data */
+static void console_write_binary(const uint8_t *p, uint32_t n) {
+	while(n) {
+		int res = ACM_tx(p, n, 0);
+		p += res;
+		n -= res;
+		if(n)
+			ACM_waitfor_txdone();
+	}
+}
+
+/* push out buffered stdio output of a command handler */
+static void console_flush(void) {
+	fflush(stdout);
+}
+
+/* "delay" statement of console scripts - sleeps, but wakes up early on Ctrl+C */
+static void console_delay(uint32_t ms) {
+	timeout_t to;
+	timeout_set(&to, MS_TO_TICKS(ms));
+	while(!SIGINT && wait_event(EVENT_SIGINT, to.end)) {}
+}
+
+/* Ctrl+C stops console scripts - SIGINT is set in USB rx handler ISR */
+static bool console_interrupted(bool clear) {
+	if(clear)
+		SIGINT = 0;
+	return SIGINT;
+}
+
+#ifdef CLOCK_GOVERNOR
+#define CLOCK_IDLE_TICKS	HZ
+
+/* drops the clock once the console is idle for CLOCK_IDLE_TICKS */
+static void clock_idle(soft_timer_t *timer) {
+	if(console_busy(&acm_console))
+		soft_timer_start(timer, CLOCK_IDLE_TICKS);
+	else
+		clock_set_speed(0);
+}
+
+static soft_timer_t clock_idle_timer = { .callback = clock_idle };
+
+static void clock_boost(void) {
+	clock_set_speed(1);
+	soft_timer_start(&clock_idle_timer, CLOCK_IDLE_TICKS);
+}
+#else
+static void clock_boost(void)	{}
+#endif
+
+/* console task: runs when USB data arrived, and while a resumable command is busy when it asked to be called
+ * again or Ctrl+C was received */
+static void console_task_run(task_t *task) {
+	uint32_t pending = 0;
+
+	clock_boost();
+	if(console_busy(&acm_console)) {
+		if(SIGINT) {
+			SIGINT = 0;
+			console_cancel(&acm_console);
+		}
+		else
+			console_poll(&acm_console);	/* not while it waits for input */
+	}
+	if(!console_busy(&acm_console)) {
+		pending = ACM_to_console(&acm_console);
+		/* a resumable command started - only Ctrl+C from now on cancels it */
+		if(console_busy(&acm_console))
+			SIGINT = 0;
+	}
+	else if(console_waiting_for_input(&acm_console))
+		pending = ACM_to_console(&acm_console);
+
+	/* pending input waits while a command is busy, so wake on Ctrl+C and when the command wants to go on */
+	if(console_busy(&acm_console) && !console_waiting_for_input(&acm_console)) {
+		task->ring = NULL;
+		task->events = EVENT_SIGINT;
+		sched_wake_in(task, MS_TO_TICKS(console_resume_delay(&acm_console)));
+	}
+	else {
+		/* a command waiting for input also gets Ctrl+C this way */
+		task->ring = &ACM_rx_fill;
+		task->events = 0;
+		/* the rest of the input after the command's line */
+		if(pending)
+			sched_wake_in(task, 0);
+		else
+			sched_cancel_deadline(task);
+	}
+}
+
+static task_t console_task = { .name = "console", .run = console_task_run, .ring = &ACM_rx_fill };
+
 #ifdef DEBUG_UART
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/gpio.h>
@@ -219,18 +693,26 @@ void u2tx(const char *s) {
 #endif
 
 int main(void) {
-	const console_init_t init_console = {.write_function = console_write};
+	const console_init_t init_console = {
+		.write_function        = console_write,
+		.flush_function        = console_flush,
+		.write_binary_function = console_write_binary,
+		.delay_function        = console_delay,
+		.interrupted_function  = console_interrupted,
+		.cycles_function       = cycles,
+		.cycles_per_us         = CORE_CLOCK_HZ / 1000000,
+	};
 	const console_command_def_t * const *cmd;
-	uint32_t last=0, now;
-#if defined(BOOT0_PIN) && defined(BOOT0_PORT)
-	uint32_t boot0_trigger = 0;
-#endif
 
 	hw_init(); // see ../common-code/platform.c
+	soft_timers_init();
 
 #ifdef BOOT0_RCC
 	rcc_periph_clock_enable(BOOT0_RCC);
 #endif
+#if defined(BOOT0_PIN) && defined(BOOT0_PORT)
+	soft_timer_start(&boot0_timer, 0);
+#endif
 
 #ifdef DEBUG_UART
 	usart_init();
@@ -239,41 +721,22 @@ int main(void) {
 
 	heartbeat_init();
 
+#ifdef PROFILER
+	profiler_init();
+#endif
+
 #ifdef BREATHING_LED
 	pwmled_init();
 #endif
 
 	/* init console & register all commands */
-	console_init(&init_console);
+	console_init(&acm_console, &init_console);
 	for(cmd=console_commands;*cmd;cmd++)
 		console_command_register(*cmd);
 
-	/* main loop */
-	while(1) {
-		SLEEP_UNTIL((last != (now=jiffies)) || ACM_rx_fill);
-
-		if(ACM_rx_fill)
-			ACM_to_console();
+	sched_add(&console_task);
+	clock_boost();
 
-		if(last == now)
-			continue;
-
-#if defined(BOOT0_PIN) && defined(BOOT0_PORT)
-		/* check BOOT0 */
-		if(gpio_get(BOOT0_PORT, BOOT0_PIN)) {
-			if(++boot0_trigger == (HZ<<1)) {
-				SCB_AIRCR = SCB_AIRCR_VECTKEY | SCB_AIRCR_SYSRESETREQ; /* trigger system reset via SCB */
-				while(1) {}
-			}
-		}
-		else
-			boot0_trigger = 0;
-#endif /* BOOT0 */
-
-#ifdef BREATHING_LED
-		breathe();
-#endif
-		heartbeat((last=now));
-	}
-	return 0;
+	/* all the work is done by the tasks - see ../common-code/sched.c */
+	sched_run();
 }
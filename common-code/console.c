@@ -20,11 +20,19 @@
 
 #include "console.h"
 
-#include <limits.h>
 #include <string.h>
-#include <stdlib.h>
 
 #define CHAR_CTRL_C     0x03
+#define CHAR_ESC        0x1b
+
+#define CHAR_SOH        0x01
+#define CHAR_STX        0x02
+#define CHAR_ETX        0x03
+#define CHAR_DLE        0x10
+
+#define CSI_MAX_VALUE   9999
+
+#define HISTORY_NONE    UINT32_MAX
 
 #define FOREACH_COMMAND(VAR) \
     for (uint32_t __i = 0; __i < m_num_commands; __i++) \
@@ -32,6 +40,7 @@
 
 typedef union {
     intptr_t value_int;
+    uintptr_t value_uint;
     const char* value_str;
     void* ptr;
 } parsed_arg_t;
@@ -55,27 +64,160 @@ CONSOLE_COMMAND_DEF(help, "List all commands, or give details about a specific c
 #endif
 #endif
 
-static console_init_t m_init;
+#if CONSOLE_BINARY_RPC
+// binary RPC packets (see console.h for the format)
+#define RPC_REPLY_OUTPUT    'O'
+#define RPC_REPLY_STATUS    'S'
+
+#if CONSOLE_HELP_COMMAND
+CONSOLE_COMMAND_DEF(rpcdesc, "List all commands as <hash> <name> <arg types> for binary RPC clients");
+#else
+CONSOLE_COMMAND_DEF(rpcdesc);
+#endif
+#endif
+
+#if CONSOLE_MACHINE_MODE
+#if CONSOLE_HELP_COMMAND
+CONSOLE_COMMAND_DEF(machine, "Switch machine mode (no echo or prompt, framed responses with status) on or off",
+    CONSOLE_BOOL_ARG_DEF(enable, "1/on to enable, 0/off to disable")
+);
+#else
+CONSOLE_COMMAND_DEF(machine,
+    CONSOLE_BOOL_ARG_DEF(enable)
+);
+#endif
+#endif
+
+#if CONSOLE_COMMAND_STATS
+#if CONSOLE_HELP_COMMAND
+CONSOLE_COMMAND_DEF(cmdstats, "Show and reset the execution statistics of all commands (prefix a command with \"time\" to time a single run)");
+#else
+CONSOLE_COMMAND_DEF(cmdstats);
+#endif
+
+typedef struct {
+    // in cycles, converted when printed - microseconds summed up as uint32 would wrap after ~71 minutes
+    uint64_t total_cycles;
+    uint32_t count;
+    uint32_t min_cycles;
+    uint32_t max_cycles;
+    uint32_t output_bytes;
+    // cycles of the calls so far of a resumable command or stream which isn't done yet
+    uint32_t run_cycles;
+} command_stats_t;
+
+// "time <command ...>" runs the command and reports how long it took
+#define TIME_PREFIX         "time "
+#define TIME_PREFIX_LEN     (sizeof(TIME_PREFIX) - 1)
+#endif
+
+#if CONSOLE_SCRIPT
+#if CONSOLE_HELP_COMMAND
+CONSOLE_COMMAND_DEF(script, "Compile a script (statements separated by ';', see console.h) to be executed by \"run\"",
+    CONSOLE_STREAM_ARG_DEF(source, "The statements")
+);
+CONSOLE_COMMAND_DEF(run, "Run the compiled script (stop it with Ctrl+C)");
+#else
+CONSOLE_COMMAND_DEF(script,
+    CONSOLE_STREAM_ARG_DEF(source)
+);
+CONSOLE_COMMAND_DEF(run);
+#endif
+
+// script bytecode instructions
+enum {
+    OP_CALL = 0,    // <command index> <number of args> <operands...>
+    OP_SET,         // <var> <operand>
+    OP_ADD,         // <var> <operand>
+    OP_DELAY,       // <operand>
+    OP_JMP,         // <target:le16>
+    OP_JZ,          // <condition> <target:le16> - jumps if the condition is false
+};
+// operands are a variable index or one of these markers followed by the value
+#define OPERAND_CONST       0xff    // <value:le32>
+#define OPERAND_STR         0xfe    // <NUL-terminated string>
+// conditions are a variable index (true if non-zero) or one of these
+#define COND_OK             0xf0
+#define COND_ERR            0xf1
+#define COND_POSITIVE       0x80    // ORed with a variable index: true if greater than zero
+// variables: a-z, the status of the last command and the counters of the repeat loops by nesting level
+#define VAR_STATUS          26
+#define VAR_COUNTER(DEPTH)  (27 + (DEPTH))
+// terminates the chains of jumps which still need their target (linked through their target fields)
+#define JUMP_CHAIN_END      0xffff
+
+enum {
+    BLOCK_REPEAT = 0,
+    BLOCK_WHILE,
+    BLOCK_IF,
+    BLOCK_ELSE,
+};
+
+#if CONSOLE_MAX_COMMANDS > 256
+#error "Scripts store 8-bit command indices, so CONSOLE_MAX_COMMANDS must not exceed 256"
+#endif
+#endif
+
+#if CONSOLE_BINARY_RPC
+// DLE <c ^ RPC_ESCAPE_XOR> stands for a request byte c which the input path would alter (see console.h)
+#define RPC_ESCAPE_XOR  0x20
+
+enum {
+    RPC_STATE_IDLE = 0,
+    RPC_STATE_LENGTH,   // got SOH
+    RPC_STATE_PAYLOAD,
+};
+#endif
+#if CONSOLE_STREAM_ARGS
+enum {
+    STREAM_STATE_NONE = 0,
+    STREAM_STATE_ACTIVE,    // passing the rest of the line to stream_cmd
+    STREAM_STATE_DISCARD,   // the arguments before the stream were invalid, so skip the rest of the line
+};
+#endif
+#if CONSOLE_FULL_CONTROL
+enum {
+    ESC_STATE_NONE = 0,
+    ESC_STATE_START,    // got ESC
+    ESC_STATE_CSI,      // got ESC [
+    ESC_STATE_SS3,      // got ESC O
+};
+#endif
+
 static console_command_def_t m_commands[CONSOLE_MAX_COMMANDS] CONSOLE_BUFFER_ATTRIBUTES;
 static uint32_t m_num_commands;
-static char m_line_buffer[CONSOLE_MAX_LINE_LENGTH] CONSOLE_BUFFER_ATTRIBUTES;
-static uint32_t m_line_len;
-static uint32_t m_cursor_pos;
-static bool m_line_invalid;
-static bool m_is_active;
-static uint32_t m_escape_sequence_index = 0;
-#if CONSOLE_HISTORY
-static char m_history_buffer[CONSOLE_HISTORY][CONSOLE_MAX_LINE_LENGTH] CONSOLE_BUFFER_ATTRIBUTES;
-static uint32_t m_history_start_index = 0;
-static uint32_t m_history_len = 0;
-static int32_t m_history_index = -1;
+#if CONSOLE_COMMAND_STATS
+// indexed like m_commands, shared by all console instances like the commands themselves
+static command_stats_t m_command_stats[CONSOLE_MAX_COMMANDS];
 #endif
+// the console whose command handler is running (for handlers, which don't get passed the console)
+static console_t* m_current;
+
+static inline bool machine_mode_active(const console_t* console) {
+#if CONSOLE_MACHINE_MODE
+    return console->machine_mode;
+#else
+    (void)console;
+    return false;
+#endif
+}
 
 static bool validate_arg_def(const console_arg_def_t* arg, bool is_last) {
     switch (arg->type) {
+        case CONSOLE_ARG_TYPE_ENUM:
+            return arg->name && arg->enum_values && arg->enum_values[0] && (!arg->is_optional || is_last);
+        case CONSOLE_ARG_TYPE_FIXED:
+            return arg->name && arg->decimals <= 9 && (!arg->is_optional || is_last);
         case CONSOLE_ARG_TYPE_INT:
+        case CONSOLE_ARG_TYPE_UINT:
+        case CONSOLE_ARG_TYPE_HEX:
+        case CONSOLE_ARG_TYPE_BOOL:
         case CONSOLE_ARG_TYPE_STR:
             return arg->name && (!arg->is_optional || is_last);
+#if CONSOLE_STREAM_ARGS
+        case CONSOLE_ARG_TYPE_STREAM:
+            return arg->name && is_last;
+#endif
         default:
             return false;
     }
@@ -90,22 +232,223 @@ static const console_command_def_t* get_command(const char* name) {
     return NULL;
 }
 
-static void write_str(const char* str) {
-    if (!m_init.write_function) {
+static void flush_output(console_t* console) {
+    if (!console->out_len) {
+        return;
+    }
+#if CONSOLE_BINARY_RPC
+    if (console->rpc_active) {
+        const uint8_t header[3] = {CHAR_SOH, RPC_REPLY_OUTPUT, console->out_len};
+        console->init.write_binary_function(header, sizeof(header));
+        console->init.write_binary_function((const uint8_t*)console->out_buffer, console->out_len);
+        console->out_len = 0;
+        return;
+    }
+#endif
+    console->out_buffer[console->out_len] = '\0';
+    console->out_len = 0;
+    if (!console->init.write_function) {
         return;
     }
-    m_init.write_function(str);
+    console->init.write_function(console->out_buffer);
+}
+
+static void write_chars(console_t* console, const char* str, uint32_t len) {
+    while (len) {
+        if (console->out_len == CONSOLE_OUTPUT_BUFFER_SIZE) {
+            flush_output(console);
+        }
+        uint32_t chunk = CONSOLE_OUTPUT_BUFFER_SIZE - console->out_len;
+        if (chunk > len) {
+            chunk = len;
+        }
+        memcpy(&console->out_buffer[console->out_len], str, chunk);
+        console->out_len += chunk;
+        str += chunk;
+        len -= chunk;
+    }
+}
+
+static void write_str(console_t* console, const char* str) {
+    write_chars(console, str, strlen(str));
+}
+
+static void write_uint(console_t* console, uint32_t n) {
+    char buf[11];
+    char* p = &buf[sizeof(buf) - 1];
+    *p = '\0';
+    do {
+        *--p = '0' + (n % 10);
+        n /= 10;
+    } while (n);
+    write_str(console, p);
+}
+
+#if CONSOLE_HELP_COMMAND || CONSOLE_COMMAND_STATS
+// writes the character c n times
+static void write_repeat(console_t* console, char c, uint32_t n) {
+    while (n) {
+        if (console->out_len == CONSOLE_OUTPUT_BUFFER_SIZE) {
+            flush_output(console);
+        }
+        uint32_t chunk = CONSOLE_OUTPUT_BUFFER_SIZE - console->out_len;
+        if (chunk > n) {
+            chunk = n;
+        }
+        memset(&console->out_buffer[console->out_len], c, chunk);
+        console->out_len += chunk;
+        n -= chunk;
+    }
+}
+#endif
+
+// the values of boolean arguments - odd indices are true
+static const char* const m_bool_values[] = {"0", "1", "off", "on", "no", "yes", "false", "true", NULL};
+
+// returns the value of a (case-insensitive) hex digit, or 16 or more if it isn't one
+static inline uint32_t digit_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    return (c >= 'a' && c <= 'f') ? (uint32_t)(c - 'a' + 10) : 16;
+}
+
+// parses the digits of an unsigned 32-bit number with the base prefixes of strtoul(str, NULL, 0): hex with a "0x"
+// prefix, octal with a leading '0', else decimal - or hex (with or without the prefix) if hex is set
+static bool parse_digits(const char* str, bool hex, uint32_t* result) {
+    uint32_t base = hex ? 16 : 10;
+    if (str[0] == '0' && (str[1] == 'x' || str[1] == 'X')) {
+        base = 16;
+        str += 2;
+    } else if (!hex && str[0] == '0' && str[1]) {
+        base = 8;
+        str++;
+    }
+    if (!*str) {
+        return false;
+    }
+    uint32_t value = 0;
+    for (; *str; str++) {
+        const uint32_t digit = digit_value(*str);
+        if (digit >= base || value > (UINT32_MAX - digit) / base) {
+            return false;
+        }
+        value = value * base + digit;
+    }
+    *result = value;
+    return true;
+}
+
+// skips leading whitespace like strtol()
+static const char* skip_space(const char* str) {
+    while (*str == ' ' || (*str >= '\t' && *str <= '\r')) {
+        str++;
+    }
+    return str;
+}
+
+// parses an unsigned 32-bit number, optionally with leading whitespace and '+' (see parse_digits())
+static bool parse_uint(const char* str, bool hex, uint32_t* result) {
+    str = skip_space(str);
+    return parse_digits((*str == '+') ? str + 1 : str, hex, result);
+}
+
+// applies an optional leading '-' to a magnitude which must then fit into an int32_t
+static bool apply_sign(bool negative, uint32_t magnitude, int32_t* result) {
+    if (magnitude > (negative ? (uint32_t)INT32_MAX + 1 : (uint32_t)INT32_MAX)) {
+        return false;
+    }
+    *result = negative ? (int32_t)(0 - magnitude) : (int32_t)magnitude;
+    return true;
+}
+
+// parses a decimal number with up to the given number of decimal places, e.g. "-1.5" -> -150 with 2 decimals
+static bool parse_fixed(const char* str, uint32_t decimals, int32_t* result) {
+    const bool negative = (*str == '-');
+    if (negative) {
+        str++;
+    }
+    uint32_t value = 0;
+    uint32_t num_digits = 0;
+    bool has_point = false;
+    for (; *str; str++) {
+        if (*str == '.' && !has_point) {
+            has_point = true;
+            continue;
+        }
+        const uint32_t digit = digit_value(*str);
+        if (digit >= 10 || (has_point && !decimals--) || value > UINT32_MAX / 10 || (value == UINT32_MAX / 10 && digit > UINT32_MAX % 10)) {
+            return false;
+        }
+        value = value * 10 + digit;
+        num_digits++;
+    }
+    if (!num_digits) {
+        return false;
+    }
+    // scale by the remaining decimal places
+    for (; decimals; decimals--) {
+        if (value > UINT32_MAX / 10) {
+            return false;
+        }
+        value *= 10;
+    }
+    return apply_sign(negative, value, result);
+}
+
+// returns the index of str in a NULL-terminated table of names, or -1
+static intptr_t find_value(const char* const* values, const char* str) {
+    for (intptr_t i = 0; values[i]; i++) {
+        if (!strcmp(values[i], str)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// parses a signed 32-bit number like strtol(str, NULL, 0): leading whitespace, then an optional sign, then a
+// decimal, "0x" hex or '0' octal number
+static bool parse_int(const char* str, int32_t* result) {
+    str = skip_space(str);
+    const bool negative = (*str == '-');
+    uint32_t magnitude;
+    return parse_digits((negative || *str == '+') ? str + 1 : str, false, &magnitude) && apply_sign(negative, magnitude, result);
 }
 
-static bool parse_arg(const char* arg_str, console_arg_type_t type, parsed_arg_t* parsed_arg) {
-    switch (type) {
+static bool parse_arg(const char* arg_str, const console_arg_def_t* arg, parsed_arg_t* parsed_arg) {
+    switch (arg->type) {
         case CONSOLE_ARG_TYPE_INT: {
-            char* end_ptr = NULL;
-            long int result = strtol(arg_str, &end_ptr, 0);
-            if (result == LONG_MAX || result == LONG_MIN || end_ptr == NULL || *end_ptr != '\0') {
+            int32_t value;
+            if (!parse_int(arg_str, &value)) {
+                return false;
+            }
+            parsed_arg->value_int = value;
+            return true;
+        }
+        case CONSOLE_ARG_TYPE_UINT:
+        case CONSOLE_ARG_TYPE_HEX: {
+            uint32_t value;
+            if (!parse_uint(arg_str, arg->type == CONSOLE_ARG_TYPE_HEX, &value)) {
                 return false;
             }
-            parsed_arg->value_int = (intptr_t)result;
+            parsed_arg->value_uint = value;
+            return true;
+        }
+        case CONSOLE_ARG_TYPE_BOOL: {
+            const intptr_t index = find_value(m_bool_values, arg_str);
+            parsed_arg->value_int = index & 1;
+            return index >= 0;
+        }
+        case CONSOLE_ARG_TYPE_ENUM:
+            parsed_arg->value_int = find_value(arg->enum_values, arg_str);
+            return parsed_arg->value_int >= 0;
+        case CONSOLE_ARG_TYPE_FIXED: {
+            int32_t value;
+            if (!parse_fixed(arg_str, arg->decimals, &value)) {
+                return false;
+            }
+            parsed_arg->value_int = value;
             return true;
         }
         case CONSOLE_ARG_TYPE_STR:
@@ -117,6 +460,38 @@ static bool parse_arg(const char* arg_str, console_arg_type_t type, parsed_arg_t
     }
 }
 
+#if CONSOLE_BINARY_RPC || CONSOLE_SCRIPT
+static inline uint32_t read_le32(const uint8_t* data) {
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+// checks a numeric argument which wasn't parsed from text (by parse_arg()) against its definition
+static bool check_arg_value(const console_arg_def_t* arg, uint32_t value) {
+    if (arg->type == CONSOLE_ARG_TYPE_BOOL) {
+        return value <= 1;
+    } else if (arg->type == CONSOLE_ARG_TYPE_ENUM) {
+        // make sure it's a valid index into the table
+        for (uint32_t i = 0; i <= value; i++) {
+            if (!arg->enum_values[i]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// stores a numeric argument in the console's args according to the signedness of its type
+static void set_numeric_arg(console_t* console, uint32_t index, const console_arg_def_t* arg, uint32_t value) {
+    parsed_arg_t parsed_arg;
+    if (arg->type == CONSOLE_ARG_TYPE_UINT || arg->type == CONSOLE_ARG_TYPE_HEX) {
+        parsed_arg.value_uint = value;
+    } else {
+        parsed_arg.value_int = (int32_t)value;
+    }
+    console->args[index] = parsed_arg.ptr;
+}
+#endif
+
 static uint32_t get_num_required_args(const console_command_def_t* cmd) {
     if (cmd->num_args == 0) {
         return 0;
@@ -124,35 +499,115 @@ static uint32_t get_num_required_args(const console_command_def_t* cmd) {
     const console_arg_def_t* last_arg = &cmd->args[cmd->num_args-1];
     switch (last_arg->type) {
         case CONSOLE_ARG_TYPE_INT:
+        case CONSOLE_ARG_TYPE_UINT:
+        case CONSOLE_ARG_TYPE_HEX:
+        case CONSOLE_ARG_TYPE_BOOL:
+        case CONSOLE_ARG_TYPE_ENUM:
+        case CONSOLE_ARG_TYPE_FIXED:
         case CONSOLE_ARG_TYPE_STR:
             if (last_arg->is_optional) {
                 return cmd->num_args - 1;
             } else {
                 return cmd->num_args;
             }
+#if CONSOLE_STREAM_ARGS
+        case CONSOLE_ARG_TYPE_STREAM:
+            // the stream may be empty
+            return cmd->num_args - 1;
+#endif
         default:
             return 0;
     }
 }
 #if CONSOLE_HISTORY
-static void history_add_line(void) {
-    if (!strcmp(m_history_buffer[(m_history_start_index + m_history_len) % CONSOLE_HISTORY], m_line_buffer)) {
-        // same as the previous history line, so don't bother re-adding it
+// arena offsets never exceed 2*CONSOLE_HISTORY_SIZE, so avoid the (software) division of a modulo
+static inline uint32_t history_wrap(uint32_t ofs) {
+    return (ofs >= CONSOLE_HISTORY_SIZE) ? ofs - CONSOLE_HISTORY_SIZE : ofs;
+}
+
+static inline uint32_t history_back(uint32_t ofs, uint32_t n) {
+    return history_wrap(ofs + CONSOLE_HISTORY_SIZE - n);
+}
+
+// returns the offset of the entry preceding the one at (or the tail) ofs
+static uint32_t history_prev(console_t* console, uint32_t ofs) {
+    const uint32_t len = console->history_arena[history_back(ofs, 1)];
+    return history_back(ofs, len + 2);
+}
+
+static uint32_t history_next(console_t* console, uint32_t ofs) {
+    return history_wrap(ofs + console->history_arena[ofs] + 2);
+}
+
+static void history_copy_out(console_t* console, uint32_t ofs, char* dst) {
+    const uint32_t len = console->history_arena[ofs];
+    ofs = history_wrap(ofs + 1);
+    const uint32_t first = (len < CONSOLE_HISTORY_SIZE - ofs) ? len : CONSOLE_HISTORY_SIZE - ofs;
+    memcpy(dst, &console->history_arena[ofs], first);
+    memcpy(&dst[first], console->history_arena, len - first);
+    dst[len] = '\0';
+}
+
+static bool history_equals_last(console_t* console, const char* line, uint32_t len) {
+    if (!console->history_used) {
+        return false;
+    }
+    uint32_t ofs = history_prev(console, console->history_tail);
+    if (console->history_arena[ofs] != len) {
+        return false;
+    }
+    for (uint32_t i = 0; i < len; i++) {
+        ofs = history_wrap(ofs + 1);
+        if (console->history_arena[ofs] != (uint8_t)line[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// returns how many leading characters the entry at ofs shares with the current line
+static uint32_t history_common_prefix(console_t* console, uint32_t ofs) {
+    const uint32_t len = console->history_arena[ofs];
+    uint32_t i = 0;
+    for (; i < len && i < console->line_len; i++) {
+        ofs = history_wrap(ofs + 1);
+        if (console->history_arena[ofs] != (uint8_t)console->line_buffer[i]) {
+            break;
+        }
+    }
+    return i;
+}
+
+static void history_put(console_t* console, uint8_t b) {
+    console->history_arena[console->history_tail] = b;
+    console->history_tail = history_wrap(console->history_tail + 1);
+}
+
+static void history_add_line(console_t* console) {
+    const uint32_t entry_len = console->line_len + 2;
+    if (entry_len > CONSOLE_HISTORY_SIZE || history_equals_last(console, console->line_buffer, console->line_len)) {
+        // too long to store or same as the previous history line, so don't bother adding it
         return;
     }
-    const uint32_t history_write_index = (m_history_start_index + m_history_len + 1) % CONSOLE_HISTORY;
-    strcpy(m_history_buffer[history_write_index], m_line_buffer);
-    if (m_history_len == CONSOLE_HISTORY) {
-        // history buffer is full, so drop the first element to clear room for the new one
-        m_history_start_index = (m_history_start_index + 1) % CONSOLE_HISTORY;
-    } else {
-        m_history_len++;
+    while (CONSOLE_HISTORY_SIZE - console->history_used < entry_len) {
+        // arena is full, so drop the oldest entries to clear room for the new one
+        const uint32_t next = history_next(console, console->history_head);
+        console->history_used -= console->history_arena[console->history_head] + 2;
+        console->history_head = next;
     }
+    history_put(console, console->line_len);
+    for (uint32_t i = 0; i < console->line_len; i++) {
+        history_put(console, console->line_buffer[i]);
+    }
+    history_put(console, console->line_len);
+    console->history_used += entry_len;
 }
 #endif
 
-static const console_command_def_t* parse_line(uint32_t* num_args) {
-    if (m_line_invalid) {
+// parses the line from offset start on
+static const console_command_def_t* parse_line(console_t* console, uint32_t start, uint32_t* num_args) {
+    if (console->line_invalid) {
+        console->status = CONSOLE_STATUS_INVALID_LINE;
         return NULL;
     }
 
@@ -160,70 +615,75 @@ static const console_command_def_t* parse_line(uint32_t* num_args) {
     const console_command_def_t* cmd = NULL;
     uint32_t arg_index = 0;
     const char* current_token = NULL;
-    for (uint32_t i = 0; i <= m_line_len; i++) {
-        const char c = m_line_buffer[i];
+    for (uint32_t i = start; i <= console->line_len; i++) {
+        const char c = console->line_buffer[i];
         if (c == ' ' || c == '\0') {
             // end of a token
             if (!current_token) {
                 if (cmd) {
                     // too much whitespace
-                    write_str("ERROR: Extra whitespace between arguments"CONSOLE_NEWLINE);
+                    write_str(console, "ERROR: Extra whitespace between arguments"CONSOLE_NEWLINE);
+                    console->status = CONSOLE_STATUS_INVALID_LINE;
                     return NULL;
                 } else {
                     bool is_empty = true;
-                    for (uint32_t j = 0; j < m_line_len; j++) {
-                        if (m_line_buffer[j] != ' ') {
+                    for (uint32_t j = 0; j < console->line_len; j++) {
+                        if (console->line_buffer[j] != ' ') {
                             is_empty = false;
                             break;
                         }
                     }
                     if (!is_empty) {
-                        write_str("ERROR: Whitespace before command"CONSOLE_NEWLINE);
+                        write_str(console, "ERROR: Whitespace before command"CONSOLE_NEWLINE);
+                        console->status = CONSOLE_STATUS_INVALID_LINE;
                     }
                     return NULL;
                 }
             }
 
 #if CONSOLE_HISTORY
-            if (!cmd) {
-                history_add_line();
+            if (!cmd && !machine_mode_active(console)) {
+                history_add_line(console);
             }
 #endif
 
             // process this token
-            m_line_buffer[i] = '\0';
+            console->line_buffer[i] = '\0';
             if (!cmd) {
                 // find the command
                 cmd = get_command(current_token);
                 if (!cmd) {
-                    write_str("ERROR: Command not found (");
-                    write_str(current_token);
-                    write_str(")"CONSOLE_NEWLINE);
+                    write_str(console, "ERROR: Command not found (");
+                    write_str(console, current_token);
+                    write_str(console, ")"CONSOLE_NEWLINE);
+                    console->status = CONSOLE_STATUS_COMMAND_NOT_FOUND;
                     return NULL;
                 }
             } else {
                 // this is an argument
                 if (arg_index == cmd->num_args) {
-                    write_str("ERROR: Too many arguments"CONSOLE_NEWLINE);
+                    write_str(console, "ERROR: Too many arguments"CONSOLE_NEWLINE);
+                    console->status = CONSOLE_STATUS_INVALID_ARGS;
                     return NULL;
                 }
                 // validate the argument
                 const console_arg_def_t* arg = &cmd->args[arg_index];
                 parsed_arg_t parsed_arg;
-                if (!parse_arg(current_token, arg->type, &parsed_arg)) {
-                    write_str("ERROR: Invalid value for '");
-                    write_str(arg->name);
-                    write_str("' (");
-                    write_str(current_token);
-                    write_str(")"CONSOLE_NEWLINE);
+                if (!parse_arg(current_token, arg, &parsed_arg)) {
+                    write_str(console, "ERROR: Invalid value for '");
+                    write_str(console, arg->name);
+                    write_str(console, "' (");
+                    write_str(console, current_token);
+                    write_str(console, ")"CONSOLE_NEWLINE);
+                    console->status = CONSOLE_STATUS_INVALID_ARGS;
                     return NULL;
                 }
-                cmd->args_ptr[arg_index] = parsed_arg.ptr;
+                console->args[arg_index] = parsed_arg.ptr;
                 arg_index++;
             }
             current_token = NULL;
         } else if (!current_token) {
-            current_token = &m_line_buffer[i];
+            current_token = &console->line_buffer[i];
         }
     }
 
@@ -231,88 +691,1084 @@ static const console_command_def_t* parse_line(uint32_t* num_args) {
     return cmd;
 }
 
-static void process_line(void) {
-    uint32_t num_args = 0;
-    const console_command_def_t* cmd = parse_line(&num_args);
-    if (!cmd) {
-        return;
-    } else if (num_args < get_num_required_args(cmd)) {
-        write_str("ERROR: Too few arguments"CONSOLE_NEWLINE);
+#if CONSOLE_COMMAND_STATS
+static uint32_t read_cycles(const console_t* console) {
+    return console->init.cycles_function ? console->init.cycles_function() : 0;
+}
+
+static uint32_t cycles_to_us(const console_t* console, uint32_t cycles) {
+    return console->init.cycles_per_us ? cycles / console->init.cycles_per_us : 0;
+}
+
+// adds one call of a handler to the statistics of its command, which count a run once it's done
+static void record_command_stats(const console_command_def_t* cmd, uint32_t cycles, uint32_t output_bytes, bool done) {
+    command_stats_t* stats = &m_command_stats[cmd - m_commands];
+    stats->total_cycles += cycles;
+    stats->output_bytes += output_bytes;
+    stats->run_cycles += cycles;
+    if (!done) {
         return;
     }
+    if (!stats->count || stats->run_cycles < stats->min_cycles) {
+        stats->min_cycles = stats->run_cycles;
+    }
+    if (stats->run_cycles > stats->max_cycles) {
+        stats->max_cycles = stats->run_cycles;
+    }
+    stats->count++;
+    stats->run_cycles = 0;
+}
 
+// returns true if the call of cmd's handler which just returned was its last one for this run
+static bool is_run_done(const console_t* console, const console_command_def_t* cmd) {
+    (void)console;
+    (void)cmd;
+#if CONSOLE_STREAM_ARGS
+    if (cmd->num_args && cmd->args[cmd->num_args - 1].type == CONSOLE_ARG_TYPE_STREAM) {
+        return console->stream.event == CONSOLE_STREAM_END || console->stream.event == CONSOLE_STREAM_ABORT;
+    }
+#endif
+#if CONSOLE_RESUMABLE
+    return !console->yielded;
+#else
+    return true;
+#endif
+}
+#endif
+
+static void call_handler(console_t* console, const console_command_def_t* cmd) {
+    // flush first, as handlers may write directly instead of through the console
+    flush_output(console);
+#if CONSOLE_COMMAND_STATS
+    // a run spans all calls of the handler (each step of a resumable command or event of a stream), excluding the
+    // time in between them
+    const uint32_t start_cycles = read_cycles(console);
+    const uint32_t start_bytes = console->output_bytes;
+#endif
+    // a console may be processed from an interrupt which preempted another console's command
+    console_t* const prev_current = m_current;
+    m_current = console;
+    // scripts run commands from within the handler of "run"
+    const bool prev_active = console->is_active;
+    console->is_active = true;
+#if CONSOLE_RESUMABLE
+    console->yielded = false;
+    console->wait_input = false;
+#endif
+    if (cmd->num_args) {
+        cmd->handler(console->args);
+    } else {
+        cmd->handler_no_args();
+    }
+    if (console->init.flush_function) {
+        console->init.flush_function();
+    }
+    flush_output(console);
+#if CONSOLE_COMMAND_STATS
+    record_command_stats(cmd, read_cycles(console) - start_cycles, console->output_bytes - start_bytes,
+        is_run_done(console, cmd));
+#endif
+    console->is_active = prev_active;
+    m_current = prev_current;
+}
+
+#if CONSOLE_STREAM_ARGS
+// passes a stream event (and chunk of data) to the handler of cmd
+static void stream_event(console_t* console, const console_command_def_t* cmd, console_stream_event_t event, const uint8_t* data, uint32_t length) {
+    console->stream.event = event;
+    console->stream.data = data;
+    console->stream.length = length;
+    call_handler(console, cmd);
+#if CONSOLE_RESUMABLE
+    // the events of a stream follow its input, so they can't be resumed
+    console->yielded = false;
+#endif
+}
+#endif
+
+// runs the handler of cmd once the first num_args entries of the console's args are filled in
+static void run_command(console_t* console, const console_command_def_t* cmd, uint32_t num_args) {
+#if CONSOLE_RESUMABLE
+    console->step = CONSOLE_STEP_START;
+#endif
     if (num_args != cmd->num_args) {
         // set the optional argument to its default value
         switch (cmd->args[num_args].type) {
             case CONSOLE_ARG_TYPE_INT:
-                cmd->args_ptr[num_args] = (void*)CONSOLE_INT_ARG_DEFAULT;
+            case CONSOLE_ARG_TYPE_BOOL:
+            case CONSOLE_ARG_TYPE_ENUM:
+                console->args[num_args] = (void*)CONSOLE_INT_ARG_DEFAULT;
+                break;
+            case CONSOLE_ARG_TYPE_UINT:
+            case CONSOLE_ARG_TYPE_HEX:
+                console->args[num_args] = (void*)CONSOLE_UINT_ARG_DEFAULT;
+                break;
+            case CONSOLE_ARG_TYPE_FIXED:
+                console->args[num_args] = (void*)CONSOLE_FIXED_ARG_DEFAULT;
                 break;
             case CONSOLE_ARG_TYPE_STR:
-                cmd->args_ptr[num_args] = (void*)CONSOLE_STR_ARG_DEFAULT;
+                console->args[num_args] = (void*)CONSOLE_STR_ARG_DEFAULT;
+                break;
+#if CONSOLE_STREAM_ARGS
+            case CONSOLE_ARG_TYPE_STREAM:
+                // the line ended right after the other arguments
+                console->stream.data = NULL;
+                console->stream.length = 0;
+                console->args[num_args] = &console->stream;
                 break;
+#endif
         }
     }
 
-    // run the handler
-    m_is_active = true;
-    if (cmd->num_args) {
-        cmd->handler(cmd->args_ptr);
+#if CONSOLE_STREAM_ARGS
+    if (cmd->num_args && cmd->args[cmd->num_args - 1].type == CONSOLE_ARG_TYPE_STREAM) {
+        // all of the stream's data is known already, so pass it right away
+        const uint8_t* const data = console->stream.data;
+        const uint32_t length = console->stream.length;
+        stream_event(console, cmd, CONSOLE_STREAM_START, NULL, 0);
+        if (length) {
+            stream_event(console, cmd, CONSOLE_STREAM_DATA, data, length);
+        }
+        stream_event(console, cmd, CONSOLE_STREAM_END, NULL, 0);
+        return;
+    }
+#endif
+    call_handler(console, cmd);
+}
+
+#if CONSOLE_RESUMABLE
+// calls the handler of a yielded command again until it's done, where it can't be continued later - an interrupt
+// (e.g. Ctrl+C) cancels it, as nothing else could
+static void run_to_completion(console_t* console, const console_command_def_t* cmd) {
+    while (console->yielded) {
+        if (console->resume_delay_ms && console->init.delay_function) {
+            console->init.delay_function(console->resume_delay_ms);
+        }
+        console->step = CONSOLE_STEP_RESUME;
+        // no input can arrive for a command which waits for it
+        if (console->wait_input || (console->init.interrupted_function && console->init.interrupted_function(false))) {
+            console->step = CONSOLE_STEP_CANCEL;
+            console->status = CONSOLE_STATUS_INTERRUPTED;
+        }
+        call_handler(console, cmd);
+    }
+}
+#endif
+
+static void run_line(console_t* console) {
+    uint32_t num_args = 0;
+    uint32_t start = 0;
+#if CONSOLE_COMMAND_STATS
+    // the command follows the prefix (which stays in the line for the history)
+    const bool timed = console->line_len > TIME_PREFIX_LEN && console->line_buffer[TIME_PREFIX_LEN] != ' ' &&
+        !strncmp(console->line_buffer, TIME_PREFIX, TIME_PREFIX_LEN);
+    if (timed) {
+        start = TIME_PREFIX_LEN;
+    }
+#endif
+    const console_command_def_t* cmd = parse_line(console, start, &num_args);
+    if (!cmd) {
+        return;
+    } else if (num_args < get_num_required_args(cmd)) {
+        write_str(console, "ERROR: Too few arguments"CONSOLE_NEWLINE);
+        console->status = CONSOLE_STATUS_INVALID_ARGS;
+        return;
+    }
+#if CONSOLE_COMMAND_STATS
+    // reported by finish_line()
+    console->timed = timed;
+    console->time_start_cycles = read_cycles(console);
+    console->time_start_bytes = console->output_bytes;
+#endif
+    run_command(console, cmd, num_args);
+#if CONSOLE_RESUMABLE
+    if (console->yielded) {
+        // continued by console_poll()
+        console->resume_cmd = cmd;
+    }
+#endif
+}
+
+#if CONSOLE_BINARY_RPC
+// 16-bit FNV-1a hash of the command name, used to address commands in RPC requests
+static uint16_t command_hash(const char* name) {
+    uint32_t hash = 2166136261u;
+    for (; *name; name++) {
+        hash ^= (uint8_t)*name;
+        hash *= 16777619u;
+    }
+    return (hash >> 16) ^ (hash & 0xffff);
+}
+
+static const console_command_def_t* get_command_by_hash(uint16_t hash) {
+    FOREACH_COMMAND(cmd_def) {
+        if (command_hash(cmd_def->name) == hash) {
+            return cmd_def;
+        }
+    }
+    return NULL;
+}
+
+// unpacks the arguments of an RPC request into the console's args - returns false if they don't match the definition
+static bool rpc_unpack_args(console_t* console, const console_command_def_t* cmd, uint8_t* data, uint32_t length, uint32_t* num_args) {
+    uint32_t ofs = 0;
+    uint32_t arg_index = 0;
+    for (; arg_index < cmd->num_args && ofs < length; arg_index++) {
+        const console_arg_def_t* arg = &cmd->args[arg_index];
+        parsed_arg_t parsed_arg;
+        switch (arg->type) {
+            case CONSOLE_ARG_TYPE_INT:
+            case CONSOLE_ARG_TYPE_UINT:
+            case CONSOLE_ARG_TYPE_HEX:
+            case CONSOLE_ARG_TYPE_BOOL:
+            case CONSOLE_ARG_TYPE_ENUM:
+            case CONSOLE_ARG_TYPE_FIXED: {
+                // all numeric types are sent as little-endian 32-bit values
+                if (length - ofs < 4) {
+                    return false;
+                }
+                const uint32_t value = read_le32(&data[ofs]);
+                ofs += 4;
+                if (!check_arg_value(arg, value)) {
+                    return false;
+                }
+                set_numeric_arg(console, arg_index, arg, value);
+                continue;
+            }
+            case CONSOLE_ARG_TYPE_STR: {
+                // NUL-terminated, so it can be used in place
+                const uint8_t* end = memchr(&data[ofs], '\0', length - ofs);
+                if (!end) {
+                    return false;
+                }
+                parsed_arg.value_str = (const char*)&data[ofs];
+                ofs = end - data + 1;
+                break;
+            }
+#if CONSOLE_STREAM_ARGS
+            case CONSOLE_ARG_TYPE_STREAM:
+                // everything else
+                console->stream.data = &data[ofs];
+                console->stream.length = length - ofs;
+                parsed_arg.ptr = &console->stream;
+                ofs = length;
+                break;
+#endif
+            default:
+                return false;
+        }
+        console->args[arg_index] = parsed_arg.ptr;
+    }
+    *num_args = arg_index;
+    return ofs == length && arg_index >= get_num_required_args(cmd);
+}
+
+// handles a complete request: <seq> <hash:le16> <args...>
+static void process_rpc_request(console_t* console, uint8_t* data, uint32_t length) {
+    const uint8_t seq = length ? data[0] : 0;
+    console->status = CONSOLE_STATUS_SUCCESS;
+    if (length < 3 || console->rpc_received > CONSOLE_MAX_LINE_LENGTH) {
+        console->status = CONSOLE_STATUS_INVALID_LINE;
     } else {
-        cmd->handler_no_args();
+        const console_command_def_t* cmd = get_command_by_hash(data[1] | (data[2] << 8));
+        uint32_t num_args = 0;
+        if (!cmd) {
+            console->status = CONSOLE_STATUS_COMMAND_NOT_FOUND;
+        } else if (!rpc_unpack_args(console, cmd, &data[3], length - 3, &num_args)) {
+            console->status = CONSOLE_STATUS_INVALID_ARGS;
+        } else {
+            console->rpc_active = true;
+#if CONSOLE_RESUMABLE
+            // discard an interrupt which happened before (e.g. the Ctrl+C a host sends to clear the line)
+            if (console->init.interrupted_function) {
+                console->init.interrupted_function(true);
+            }
+#endif
+            run_command(console, cmd, num_args);
+#if CONSOLE_RESUMABLE
+            run_to_completion(console, cmd);
+#endif
+            console->rpc_active = false;
+        }
+    }
+    // status: SOH 'S' <seq> <status:le32>
+    const uint32_t status = console->status;
+    const uint8_t reply[7] = {CHAR_SOH, RPC_REPLY_STATUS, seq, status, status >> 8, status >> 16, status >> 24};
+    console->init.write_binary_function(reply, sizeof(reply));
+}
+
+static void finish_rpc_request(console_t* console) {
+    console->rpc_state = RPC_STATE_IDLE;
+    process_rpc_request(console, (uint8_t*)console->line_buffer, (console->rpc_len < CONSOLE_MAX_LINE_LENGTH) ? console->rpc_len : CONSOLE_MAX_LINE_LENGTH);
+    console->line_len = 0;
+    console->line_buffer[0] = '\0';
+}
+
+// feeds received data to the RPC request parser - returns the number of bytes consumed
+static uint32_t process_rpc_data(console_t* console, const uint8_t* data, uint32_t length) {
+    uint32_t i = 0;
+    while (i < length && console->rpc_state != RPC_STATE_IDLE) {
+        uint8_t c = data[i++];
+        if (console->rpc_escape) {
+            console->rpc_escape = false;
+            c ^= RPC_ESCAPE_XOR;
+        } else if (c == CHAR_DLE) {
+            console->rpc_escape = true;
+            continue;
+        }
+        if (console->rpc_state == RPC_STATE_LENGTH) {
+            console->rpc_len = c;
+            console->rpc_received = 0;
+            console->rpc_state = RPC_STATE_PAYLOAD;
+            if (!console->rpc_len) {
+                finish_rpc_request(console);
+            }
+            continue;
+        }
+        // anything beyond the line buffer is dropped
+        if (console->rpc_received < CONSOLE_MAX_LINE_LENGTH) {
+            console->line_buffer[console->rpc_received] = c;
+        }
+        if (++console->rpc_received == console->rpc_len) {
+            finish_rpc_request(console);
+        }
+    }
+    return i;
+}
+#endif
+
+#if CONSOLE_SCRIPT
+static const char m_script_full[] = "Script too long";
+// a plain integer, for the values of set, add, delay and repeat
+static const console_arg_def_t m_script_int_arg = {.type = CONSOLE_ARG_TYPE_INT};
+
+static bool script_emit(console_script_t* prog, const void* code, uint32_t length) {
+    if (length > CONSOLE_SCRIPT_SIZE - prog->code_len) {
+        return false;
+    }
+    memcpy(&prog->code[prog->code_len], code, length);
+    prog->code_len += length;
+    return true;
+}
+
+// emits a jump target and returns its position, so it can be patched or linked into a chain
+static bool script_emit_target(console_script_t* prog, uint16_t target, uint16_t* pos) {
+    const uint8_t code[2] = {target, target >> 8};
+    *pos = prog->code_len;
+    return script_emit(prog, code, sizeof(code));
+}
+
+// sets the target of the chain of jumps starting at pos
+static void script_patch(console_script_t* prog, uint16_t pos, uint32_t target) {
+    while (pos != JUMP_CHAIN_END) {
+        const uint16_t next = prog->code[pos] | (prog->code[pos + 1] << 8);
+        prog->code[pos] = target;
+        prog->code[pos + 1] = target >> 8;
+        pos = next;
+    }
+}
+
+// returns the index of a variable name (a-z, or ? for the status of the last command), or -1
+static int32_t script_parse_var(const char* str, bool allow_status) {
+    if (str[0] && !str[1]) {
+        if (str[0] >= 'a' && str[0] <= 'z') {
+            return str[0] - 'a';
+        } else if (allow_status && str[0] == '?') {
+            return VAR_STATUS;
+        }
+    }
+    return -1;
+}
+
+// returns the condition for "ok", "err" or "$<var>", or -1
+static int32_t script_parse_cond(const char* str) {
+    if (!strcmp(str, "ok")) {
+        return COND_OK;
+    } else if (!strcmp(str, "err")) {
+        return COND_ERR;
+    } else if (str[0] == '$') {
+        return script_parse_var(&str[1], true);
+    }
+    return -1;
+}
+
+// emits a numeric operand, which is $<var> or a literal parsed according to arg - returns an error message or NULL
+static const char* script_emit_operand(console_script_t* prog, const char* str, const console_arg_def_t* arg) {
+    if (str[0] == '$') {
+        const int32_t var = script_parse_var(&str[1], true);
+        const uint8_t code = var;
+        if (var < 0) {
+            return "Invalid variable";
+        }
+        return script_emit(prog, &code, 1) ? NULL : m_script_full;
+    }
+    // check the literal right away, so only variables need to be checked when running
+    parsed_arg_t parsed_arg;
+    if (!parse_arg(str, arg, &parsed_arg)) {
+        return "Invalid value";
+    }
+    const uint32_t value = parsed_arg.value_uint;
+    const uint8_t code[5] = {OPERAND_CONST, value, value >> 8, value >> 16, value >> 24};
+    return script_emit(prog, code, sizeof(code)) ? NULL : m_script_full;
+}
+
+// splits a statement at (any number of) spaces - returns the number of tokens, or more than max_tokens if they don't fit
+static uint32_t script_tokenize(char* stmt, char** tokens, uint32_t max_tokens) {
+    uint32_t num_tokens = 0;
+    while (*stmt) {
+        if (*stmt == ' ') {
+            *stmt++ = '\0';
+            continue;
+        } else if (num_tokens == max_tokens) {
+            return max_tokens + 1;
+        }
+        tokens[num_tokens++] = stmt;
+        while (*stmt && *stmt != ' ') {
+            stmt++;
+        }
+    }
+    return num_tokens;
+}
+
+// opens a repeat, while or if block - returns an error message or NULL
+static const char* script_compile_block(console_t* console, const char* keyword, const char* param) {
+    console_script_t* prog = &console->script;
+    if (prog->depth == CONSOLE_SCRIPT_MAX_DEPTH) {
+        return "Nested too deeply";
+    }
+    int32_t cond;
+    uint8_t kind;
+    if (!strcmp(keyword, "repeat")) {
+        // the counter of this nesting level counts down to 0
+        const uint8_t code[2] = {OP_SET, VAR_COUNTER(prog->depth)};
+        if (!script_emit(prog, code, sizeof(code))) {
+            return m_script_full;
+        }
+        const char* error = script_emit_operand(prog, param, &m_script_int_arg);
+        if (error) {
+            return error;
+        }
+        cond = COND_POSITIVE | VAR_COUNTER(prog->depth);
+        kind = BLOCK_REPEAT;
+    } else {
+        cond = script_parse_cond(param);
+        if (cond < 0) {
+            return "Invalid condition (expected ok, err or $<var>)";
+        }
+        kind = (keyword[0] == 'w') ? BLOCK_WHILE : BLOCK_IF;
+    }
+    console_script_block_t* block = &prog->blocks[prog->depth];
+    const uint8_t code[2] = {OP_JZ, cond};
+    block->kind = kind;
+    block->start = prog->code_len;
+    block->breaks = JUMP_CHAIN_END;
+    if (!script_emit(prog, code, sizeof(code)) || !script_emit_target(prog, JUMP_CHAIN_END, &block->jump)) {
+        return m_script_full;
+    }
+    prog->depth++;
+    return NULL;
+}
+
+// closes the innermost block - returns an error message or NULL
+static const char* script_compile_end(console_t* console) {
+    console_script_t* prog = &console->script;
+    if (!prog->depth) {
+        return "end without repeat, while or if";
+    }
+    prog->depth--;
+    console_script_block_t* block = &prog->blocks[prog->depth];
+    if (block->kind == BLOCK_REPEAT) {
+        const uint8_t code[7] = {OP_ADD, VAR_COUNTER(prog->depth), OPERAND_CONST, 0xff, 0xff, 0xff, 0xff};
+        if (!script_emit(prog, code, sizeof(code))) {
+            return m_script_full;
+        }
+    }
+    if (block->kind == BLOCK_REPEAT || block->kind == BLOCK_WHILE) {
+        // jump back to the condition
+        const uint8_t code = OP_JMP;
+        uint16_t pos;
+        if (!script_emit(prog, &code, 1) || !script_emit_target(prog, block->start, &pos)) {
+            return m_script_full;
+        }
+    }
+    script_patch(prog, block->jump, prog->code_len);
+    script_patch(prog, block->breaks, prog->code_len);
+    return NULL;
+}
+
+// compiles a call of a registered command - returns an error message or NULL
+static const char* script_compile_call(console_t* console, char** tokens, uint32_t num_tokens) {
+    console_script_t* prog = &console->script;
+    const console_command_def_t* cmd = get_command(tokens[0]);
+    const uint32_t num_args = num_tokens - 1;
+    if (!cmd) {
+        return "Command not found";
+    } else if (cmd->num_args && cmd->args[cmd->num_args - 1].type == CONSOLE_ARG_TYPE_STREAM) {
+        return "Commands with streamed arguments can't be used in scripts";
+    } else if (num_args < get_num_required_args(cmd) || num_args > cmd->num_args) {
+        return "Wrong number of arguments";
+    }
+    const uint8_t code[3] = {OP_CALL, cmd - m_commands, num_args};
+    if (!script_emit(prog, code, sizeof(code))) {
+        return m_script_full;
+    }
+    for (uint32_t i = 0; i < num_args; i++) {
+        const char* arg_str = tokens[i + 1];
+        if (cmd->args[i].type == CONSOLE_ARG_TYPE_STR) {
+            const uint8_t marker = OPERAND_STR;
+            if (!script_emit(prog, &marker, 1) || !script_emit(prog, arg_str, strlen(arg_str) + 1)) {
+                return m_script_full;
+            }
+        } else {
+            const char* error = script_emit_operand(prog, arg_str, &cmd->args[i]);
+            if (error) {
+                return error;
+            }
+        }
+    }
+    return NULL;
+}
+
+// compiles one statement (which gets split into tokens in place) - returns an error message or NULL
+static const char* script_compile_statement(console_t* console, char* stmt) {
+    console_script_t* prog = &console->script;
+    char* tokens[CONSOLE_MAX_ARGS + 1];
+    const uint32_t num_tokens = script_tokenize(stmt, tokens, CONSOLE_MAX_ARGS + 1);
+    if (!num_tokens) {
+        // empty statements are fine, e.g. after the last ';'
+        return NULL;
+    } else if (num_tokens > CONSOLE_MAX_ARGS + 1) {
+        return "Too many arguments";
+    }
+    const char* keyword = tokens[0];
+    if (!strcmp(keyword, "set") || !strcmp(keyword, "add")) {
+        const int32_t var = (num_tokens == 3) ? script_parse_var(tokens[1], false) : -1;
+        const uint8_t code[2] = {(keyword[0] == 's') ? OP_SET : OP_ADD, var};
+        if (var < 0) {
+            return "Expected: set|add <a-z> <value>";
+        } else if (!script_emit(prog, code, sizeof(code))) {
+            return m_script_full;
+        }
+        return script_emit_operand(prog, tokens[2], &m_script_int_arg);
+    } else if (!strcmp(keyword, "delay")) {
+        const uint8_t code = OP_DELAY;
+        if (!console->init.delay_function) {
+            return "delay isn't supported";
+        } else if (num_tokens != 2) {
+            return "Expected: delay <ms>";
+        } else if (!script_emit(prog, &code, 1)) {
+            return m_script_full;
+        }
+        return script_emit_operand(prog, tokens[1], &m_script_int_arg);
+    } else if (!strcmp(keyword, "repeat") || !strcmp(keyword, "while") || !strcmp(keyword, "if")) {
+        if (num_tokens != 2) {
+            return "Expected: repeat <n>, while <cond> or if <cond>";
+        }
+        return script_compile_block(console, keyword, tokens[1]);
+    } else if (!strcmp(keyword, "else")) {
+        console_script_block_t* block = prog->depth ? &prog->blocks[prog->depth - 1] : NULL;
+        const uint8_t code = OP_JMP;
+        uint16_t pos;
+        if (num_tokens != 1 || !block || block->kind != BLOCK_IF) {
+            return "else without if";
+        } else if (!script_emit(prog, &code, 1) || !script_emit_target(prog, JUMP_CHAIN_END, &pos)) {
+            return m_script_full;
+        }
+        // a false condition continues after the jump over the else branch, which is patched by "end"
+        script_patch(prog, block->jump, prog->code_len);
+        block->jump = pos;
+        block->kind = BLOCK_ELSE;
+        return NULL;
+    } else if (!strcmp(keyword, "break")) {
+        const uint8_t code = OP_JMP;
+        uint32_t i = prog->depth;
+        while (i && prog->blocks[i - 1].kind != BLOCK_REPEAT && prog->blocks[i - 1].kind != BLOCK_WHILE) {
+            i--;
+        }
+        if (num_tokens != 1 || !i) {
+            return "break outside of a loop";
+        } else if (!script_emit(prog, &code, 1)) {
+            return m_script_full;
+        }
+        // link it into the loop's chain of breaks, which is patched by "end"
+        return script_emit_target(prog, prog->blocks[i - 1].breaks, &prog->blocks[i - 1].breaks) ? NULL : m_script_full;
+    } else if (!strcmp(keyword, "end")) {
+        return (num_tokens == 1) ? script_compile_end(console) : "Expected: end";
+    }
+    return script_compile_call(console, tokens, num_tokens);
+}
+
+// compiles the statement received so far
+static void script_compile_pending(console_t* console) {
+    console_script_t* prog = &console->script;
+    prog->stmt[prog->stmt_len] = '\0';
+    prog->error = script_compile_statement(console, prog->stmt);
+    if (prog->error) {
+        // undo the tokenization to keep the statement for the error message
+        for (uint32_t i = 0; i < prog->stmt_len; i++) {
+            if (!prog->stmt[i]) {
+                prog->stmt[i] = ' ';
+            }
+        }
+        return;
+    }
+    prog->stmt_len = 0;
+}
+
+static int32_t script_read_operand(const console_script_t* prog, uint32_t* pc) {
+    const uint8_t* operand = &prog->code[*pc];
+    if (operand[0] == OPERAND_CONST) {
+        *pc += 5;
+        return read_le32(&operand[1]);
+    }
+    *pc += 1;
+    return prog->vars[operand[0]];
+}
+
+static bool script_check_cond(const console_script_t* prog, uint8_t cond) {
+    if (cond == COND_OK) {
+        return prog->vars[VAR_STATUS] == CONSOLE_STATUS_SUCCESS;
+    } else if (cond == COND_ERR) {
+        return prog->vars[VAR_STATUS] != CONSOLE_STATUS_SUCCESS;
+    } else if (cond & COND_POSITIVE) {
+        return prog->vars[cond & ~COND_POSITIVE] > 0;
+    }
+    return prog->vars[cond] != 0;
+}
+
+// executes the OP_CALL at pc - returns the pc of the next instruction
+static uint32_t script_call(console_t* console, uint32_t pc) {
+    console_script_t* prog = &console->script;
+    const console_command_def_t* cmd = &m_commands[prog->code[pc + 1]];
+    const uint32_t num_args = prog->code[pc + 2];
+    bool valid = true;
+    pc += 3;
+    for (uint32_t i = 0; i < num_args; i++) {
+        if (prog->code[pc] == OPERAND_STR) {
+            const char* str = (const char*)&prog->code[pc + 1];
+            console->args[i] = (void*)str;
+            pc += strlen(str) + 2;
+        } else {
+            // variables may hold anything, so check them like RPC arguments
+            const uint32_t value = script_read_operand(prog, &pc);
+            valid = valid && check_arg_value(&cmd->args[i], value);
+            set_numeric_arg(console, i, &cmd->args[i], value);
+        }
+    }
+    if (!valid) {
+        write_str(console, "ERROR: Invalid argument value for ");
+        write_str(console, cmd->name);
+        write_str(console, CONSOLE_NEWLINE);
+        prog->vars[VAR_STATUS] = CONSOLE_STATUS_INVALID_ARGS;
+        return pc;
+    }
+    console->status = CONSOLE_STATUS_SUCCESS;
+#if CONSOLE_RESUMABLE
+    // the step of "run" itself, which may still yield after this command
+    const uint8_t step = console->step;
+#endif
+    run_command(console, cmd, num_args);
+#if CONSOLE_RESUMABLE
+    run_to_completion(console, cmd);
+    console->step = step;
+#endif
+    prog->vars[VAR_STATUS] = console->status;
+    return pc;
+}
+
+// runs the compiled script from prog->pc until it's done or yields in a delay statement - returns the status of the
+// last command or CONSOLE_STATUS_INTERRUPTED
+static int32_t script_run(console_t* console) {
+    console_script_t* prog = &console->script;
+    bool(*const interrupted)(bool) = console->init.interrupted_function;
+    uint32_t pc = prog->pc;
+    while (pc < prog->code_len) {
+        if (interrupted && interrupted(false)) {
+            write_str(console, "Interrupted"CONSOLE_NEWLINE);
+            return CONSOLE_STATUS_INTERRUPTED;
+        }
+        const uint8_t* code = &prog->code[pc];
+        switch (code[0]) {
+            case OP_CALL:
+                pc = script_call(console, pc);
+                break;
+            case OP_SET:
+            case OP_ADD: {
+                pc += 2;
+                const int32_t value = script_read_operand(prog, &pc);
+                // wrap around rather than overflow
+                prog->vars[code[1]] = (uint32_t)((code[0] == OP_ADD) ? prog->vars[code[1]] : 0) + (uint32_t)value;
+                break;
+            }
+            case OP_DELAY: {
+                pc += 1;
+                const int32_t ms = script_read_operand(prog, &pc);
+                if (ms > 0) {
+#if CONSOLE_RESUMABLE
+                    // instead of sleeping, return and get called again (by console_poll(), or after the
+                    // delay_function in run_to_completion())
+                    prog->pc = pc;
+                    console_yield_for(ms);
+                    return prog->vars[VAR_STATUS];
+#else
+                    console->init.delay_function(ms);
+#endif
+                }
+                break;
+            }
+            case OP_JMP:
+                pc = code[1] | (code[2] << 8);
+                break;
+            case OP_JZ:
+                pc = script_check_cond(prog, code[1]) ? pc + 4 : (uint32_t)(code[2] | (code[3] << 8));
+                break;
+            default:
+                // should never get here
+                pc = prog->code_len;
+                break;
+        }
+    }
+    return prog->vars[VAR_STATUS];
+}
+#endif
+
+#if CONSOLE_MACHINE_MODE
+// frame: STX <seq> NEWLINE <output> ETX <seq> ' ' <status> NEWLINE
+static void write_frame_start(console_t* console) {
+    write_str(console, "\x02");
+    write_uint(console, console->frame_seq);
+    write_str(console, CONSOLE_NEWLINE);
+    // the output from here on is escaped, once it's written while the console is current
+    console->in_frame = true;
+}
+
+static void write_frame_end(console_t* console) {
+    console->in_frame = false;
+    write_str(console, "\x03");
+    write_uint(console, console->frame_seq);
+    write_str(console, console->status < 0 ? " -" : " ");
+    write_uint(console, console->status < 0 ? -(uint32_t)console->status : (uint32_t)console->status);
+    write_str(console, CONSOLE_NEWLINE);
+    console->frame_seq++;
+}
+#endif
+
+// completes the response to a line once its command is done
+static void finish_line(console_t* console, bool framed) {
+#if CONSOLE_COMMAND_STATS
+    if (console->timed) {
+        const uint32_t cycles = read_cycles(console) - console->time_start_cycles;
+        write_str(console, "time: ");
+        write_uint(console, cycles_to_us(console, cycles));
+        write_str(console, " us, ");
+        write_uint(console, cycles);
+        write_str(console, " cycles, ");
+        write_uint(console, console->output_bytes - console->time_start_bytes);
+        write_str(console, " bytes"CONSOLE_NEWLINE);
+        console->timed = false;
+    }
+#endif
+#if CONSOLE_MACHINE_MODE
+    if (framed || console->machine_mode) {
+        // a started frame is completed even if machine mode was just switched off, and one is also
+        // sent if it was just switched on, so the host can sync on it
+        write_frame_end(console);
+    }
+#else
+    (void)console;
+    (void)framed;
+#endif
+}
+
+static inline bool command_pending(const console_t* console) {
+#if CONSOLE_RESUMABLE
+    return console->resume_cmd != NULL;
+#else
+    (void)console;
+    return false;
+#endif
+}
+
+static void process_line(console_t* console) {
+    console->status = CONSOLE_STATUS_SUCCESS;
+    const bool framed = machine_mode_active(console);
+#if CONSOLE_MACHINE_MODE
+    if (framed) {
+        if (!console->line_len) {
+            // hosts may send empty lines, e.g. to sync, so don't respond to those
+            return;
+        }
+        write_frame_start(console);
+    }
+#endif
+    run_line(console);
+#if CONSOLE_RESUMABLE
+    if (console->resume_cmd) {
+        // finished by console_poll() or console_cancel()
+        console->resume_framed = framed;
+        return;
+    }
+#endif
+    finish_line(console, framed);
+}
+
+static void reset_line_and_print_prompt(console_t* console) {
+#if CONSOLE_HISTORY
+    console->history_pos = HISTORY_NONE;
+#endif
+#if CONSOLE_FULL_CONTROL
+    console->escape_state = ESC_STATE_NONE;
+#endif
+    console->line_len = 0;
+    console->cursor_pos = 0;
+    console->line_invalid = false;
+    console->line_buffer[0] = '\0';
+#if CONSOLE_MACHINE_MODE
+    if (console->machine_mode) {
+        return;
+    }
+#endif
+    write_str(console, CONSOLE_PROMPT);
+}
+
+#if CONSOLE_STREAM_ARGS
+// returns the command if the line holds a command with a streamed argument and all the arguments before it,
+// followed by a single space
+static const console_command_def_t* get_stream_command(const console_t* console) {
+    const char* const line = console->line_buffer;
+    const uint32_t len = console->line_len;
+    if (len < 2 || line[0] == ' ' || line[len - 1] != ' ' || line[len - 2] == ' ') {
+        return NULL;
+    }
+    uint32_t num_tokens = 0;
+    for (uint32_t i = 0; i < len; i++) {
+        if (line[i] != ' ' && (!i || line[i - 1] == ' ')) {
+            num_tokens++;
+        }
+    }
+    const uint32_t name_len = (const char*)memchr(line, ' ', len) - line;
+    FOREACH_COMMAND(cmd_def) {
+        if (cmd_def->num_args == num_tokens && cmd_def->args[num_tokens - 1].type == CONSOLE_ARG_TYPE_STREAM &&
+            !strncmp(cmd_def->name, line, name_len) && cmd_def->name[name_len] == '\0') {
+            return cmd_def;
+        }
+    }
+    return NULL;
+}
+
+// starts passing the rest of the line to the streamed argument once the arguments before it are complete
+static void check_stream_start(console_t* console) {
+    if (console->line_invalid || console->cursor_pos != console->line_len || !get_stream_command(console)) {
+        return;
+    }
+    console->status = CONSOLE_STATUS_SUCCESS;
+#if CONSOLE_MACHINE_MODE
+    if (console->machine_mode) {
+        write_frame_start(console);
+    }
+#endif
+    // drop the space after the last argument, as parse_line() would reject it
+    console->line_len--;
+    console->cursor_pos = console->line_len;
+    console->line_buffer[console->line_len] = '\0';
+    uint32_t num_args = 0;
+    const console_command_def_t* cmd = parse_line(console, 0, &num_args);
+    if (!cmd) {
+        console->stream_state = STREAM_STATE_DISCARD;
+        return;
+    }
+    console->stream_state = STREAM_STATE_ACTIVE;
+    console->stream_cmd = cmd;
+    console->args[num_args] = &console->stream;
+    stream_event(console, cmd, CONSOLE_STREAM_START, NULL, 0);
+}
+
+// passes received data to the streamed argument until the end of the line - returns the number of bytes consumed
+static uint32_t process_stream_data(console_t* console, const uint8_t* data, uint32_t length) {
+    uint32_t n = 0;
+    while (n < length && data[n] != CONSOLE_RETURN_KEY && data[n] != CHAR_CTRL_C) {
+        n++;
+    }
+    if (n && console->stream_state == STREAM_STATE_ACTIVE) {
+        if (!machine_mode_active(console)) {
+            // echo, but without any line editing
+            write_chars(console, (const char*)data, n);
+        }
+        stream_event(console, console->stream_cmd, CONSOLE_STREAM_DATA, data, n);
+    }
+    if (n == length) {
+        return n;
+    }
+    // end of the line
+    if (!machine_mode_active(console)) {
+        write_str(console, CONSOLE_NEWLINE);
+    }
+    if (console->stream_state == STREAM_STATE_ACTIVE) {
+        stream_event(console, console->stream_cmd, (data[n] == CHAR_CTRL_C) ? CONSOLE_STREAM_ABORT : CONSOLE_STREAM_END, NULL, 0);
+    }
+    console->stream_state = STREAM_STATE_NONE;
+#if CONSOLE_MACHINE_MODE
+    if (console->machine_mode) {
+        write_frame_end(console);
+    }
+#endif
+    reset_line_and_print_prompt(console);
+    return n + 1;
+}
+#endif
+
+static inline bool is_printable(uint8_t c) {
+    return c >= ' ' && c <= '~';
+}
+
+// returns the length of the run of printable characters at the start of data
+static uint32_t printable_run_length(const uint8_t* data, uint32_t length) {
+    uint32_t n = 0;
+    while (n < length && is_printable(data[n])) {
+        n++;
+#if CONSOLE_STREAM_ARGS
+        if (data[n - 1] == ' ') {
+            // a space may complete the arguments before a streamed one, so the run ends there
+            break;
+        }
+#endif
+    }
+    return n;
+}
+
+// keeps track of the longest line for console_line_peak()
+static void note_line_len(console_t* console) {
+    if (console->line_len > console->line_len_max) {
+        console->line_len_max = console->line_len;
+    }
+}
+
+// inserts n characters at the cursor position with a single move of the line's tail
+static void insert_chars(console_t* console, const uint8_t* chars, uint32_t n) {
+    const uint32_t space = CONSOLE_MAX_LINE_LENGTH - 1 - console->line_len;
+    if (n > space) {
+        // not all of it fits into the line buffer, so mark the line invalid
+        n = space;
+        console->line_invalid = true;
+    }
+    if (console->cursor_pos != console->line_len) {
+        // shift the existing data to the right to make space
+        memmove(&console->line_buffer[console->cursor_pos + n], &console->line_buffer[console->cursor_pos], console->line_len - console->cursor_pos);
+    }
+    memcpy(&console->line_buffer[console->cursor_pos], chars, n);
+    console->cursor_pos += n;
+    console->line_len += n;
+    console->line_buffer[console->line_len] = '\0';
+    note_line_len(console);
+}
+
+#if CONSOLE_FULL_CONTROL
+// writes ESC [ <n> <final>
+static void write_csi(console_t* console, uint32_t n, char final) {
+    const char final_str[2] = {final, '\0'};
+    write_str(console, "\x1b[");
+    write_uint(console, n);
+    write_str(console, final_str);
+}
+
+// moves the terminal cursor (not console->cursor_pos) n columns to the left
+static void cursor_left(console_t* console, uint32_t n) {
+    if (n == 1) {
+        write_str(console, "\b");
+    } else if (n) {
+        write_csi(console, n, 'D');
+    }
+}
+
+// moves the terminal cursor (not console->cursor_pos) n columns to the right
+static void cursor_right(console_t* console, uint32_t n) {
+    if (n == 1) {
+        // re-writing the character is shorter than an escape sequence
+        write_chars(console, &console->line_buffer[console->cursor_pos], 1);
+    } else if (n) {
+        write_csi(console, n, 'C');
+    }
+}
+
+static void move_cursor_to(console_t* console, uint32_t pos) {
+    if (pos > console->line_len) {
+        pos = console->line_len;
+    }
+    if (pos < console->cursor_pos) {
+        cursor_left(console, console->cursor_pos - pos);
+    } else {
+        cursor_right(console, pos - console->cursor_pos);
+    }
+    console->cursor_pos = pos;
+}
+
+static uint32_t word_start_before_cursor(console_t* console) {
+    uint32_t pos = console->cursor_pos;
+    while (pos && console->line_buffer[pos - 1] == ' ') {
+        pos--;
     }
-    m_is_active = false;
+    while (pos && console->line_buffer[pos - 1] != ' ') {
+        pos--;
+    }
+    return pos;
 }
 
-static void reset_line_and_print_prompt(void) {
-#if CONSOLE_HISTORY
-    m_history_index = -1;
-#endif
-    m_escape_sequence_index = 0;
-    m_line_len = 0;
-    m_cursor_pos = 0;
-    m_line_invalid = false;
-    m_line_buffer[0] = '\0';
-    write_str(CONSOLE_PROMPT);
+static uint32_t word_end_after_cursor(console_t* console) {
+    uint32_t pos = console->cursor_pos;
+    while (pos < console->line_len && console->line_buffer[pos] == ' ') {
+        pos++;
+    }
+    while (pos < console->line_len && console->line_buffer[pos] != ' ') {
+        pos++;
+    }
+    return pos;
 }
 
-static void push_char(char c) {
-    if (m_cursor_pos != m_line_len) {
-        // shift the existing data to the right to make space
-        memmove(&m_line_buffer[m_cursor_pos + 1], &m_line_buffer[m_cursor_pos], m_line_len - m_cursor_pos);
-    }
-    m_line_buffer[m_cursor_pos] = c;
-    m_cursor_pos++;
-    m_line_len++;
-    m_line_buffer[m_line_len] = '\0';
-    if (m_line_len == CONSOLE_MAX_LINE_LENGTH) {
-        // filled up the line buffer, so mark the line invalid
-        m_line_invalid = true;
+// removes the character under the cursor and redraws the rest of the line
+static void delete_at_cursor(console_t* console) {
+    if (console->cursor_pos == console->line_len) {
+        return;
     }
+    // shift all the characters in the line down
+    memmove(&console->line_buffer[console->cursor_pos], &console->line_buffer[console->cursor_pos + 1], console->line_len - console->cursor_pos - 1);
+    console->line_len--;
+    console->line_buffer[console->line_len] = '\0';
+    write_str(console, &console->line_buffer[console->cursor_pos]);
+    write_str(console, " ");
+    cursor_left(console, console->line_len - console->cursor_pos + 1);
 }
 
-#if CONSOLE_FULL_CONTROL
-static void move_cursor_to_end(void) {
-    if (m_cursor_pos == m_line_len) {
+static void move_cursor_to_end(console_t* console) {
+    if (console->cursor_pos == console->line_len) {
         return;
     }
-    write_str(&m_line_buffer[m_cursor_pos]);
-    m_cursor_pos = m_line_len;
+    write_str(console, &console->line_buffer[console->cursor_pos]);
+    console->cursor_pos = console->line_len;
 }
 
-static void erase_current_line(uint32_t new_line_line) {
-    if (new_line_line < m_line_len) {
-        // TODO: could optimize this to not have to write out characters we're just going to erase
-        move_cursor_to_end();
-        // erase the characters which the new line won't overwrite
-        const uint32_t char_to_erase = m_line_len - new_line_line;
-        for (uint32_t i = 0; i < char_to_erase; i++) {
-            write_str("\b");
-        }
-        for (uint32_t i = 0; i < char_to_erase; i++) {
-            write_str(" ");
-        }
+// erases everything from the cursor to the end of the terminal line
+static void erase_to_end_of_line(console_t* console) {
+    write_str(console, "\x1b[K");
+}
+
+// updates the terminal after console->line_buffer changed from an on-screen line of old_len characters
+// which shared its first common characters with the new contents - only the changed suffix is sent
+static void redraw_line(console_t* console, uint32_t common, uint32_t old_len) {
+    if (common > console->line_len) {
+        common = console->line_len;
+    }
+    // console->cursor_pos is still the on-screen position within the old line here
+    if (common < console->cursor_pos) {
+        cursor_left(console, console->cursor_pos - common);
+    } else if (common > console->cursor_pos) {
+        // the characters in between are unchanged, so cursor_right(console) may re-write them
+        cursor_right(console, common - console->cursor_pos);
     }
-    write_str("\r");
+    write_str(console, &console->line_buffer[common]);
+    if (console->line_len < old_len) {
+        erase_to_end_of_line(console);
+    }
+    console->cursor_pos = console->line_len;
 }
 #endif
 
@@ -328,15 +1784,42 @@ static const char* command_tab_complete_iterator(bool start) {
     return m_commands[iter_index++].name;
 }
 
-static void do_tab_complete(void) {
-    m_line_buffer[m_line_len] = '\0';
-    const char* prefix = m_line_buffer;
-    uint32_t prefix_length = m_line_len;
+// the names of the enum or boolean argument being completed
+static const char* const* m_tab_complete_values;
+
+static const char* value_tab_complete_iterator(bool start) {
+    static uint32_t iter_index = 0;
+    if (start) {
+        iter_index = 0;
+    }
+    const char* value = m_tab_complete_values[iter_index];
+    if (value) {
+        iter_index++;
+    }
+    return value;
+}
+
+// returns the names an argument can take, or NULL if they aren't known
+static const char* const* get_arg_values(const console_arg_def_t* arg_def) {
+    switch (arg_def->type) {
+        case CONSOLE_ARG_TYPE_BOOL:
+            return m_bool_values;
+        case CONSOLE_ARG_TYPE_ENUM:
+            return arg_def->enum_values;
+        default:
+            return NULL;
+    }
+}
+
+static void do_tab_complete(console_t* console) {
+    console->line_buffer[console->line_len] = '\0';
+    const char* prefix = console->line_buffer;
+    uint32_t prefix_length = console->line_len;
     uint32_t offset = 0;
     console_tab_complete_iterator_t iter = command_tab_complete_iterator;
     FOREACH_COMMAND(cmd_def) {
         const uint32_t cmd_name_len = strlen(cmd_def->name);
-        if (m_line_len < cmd_name_len + 1 || strncmp(cmd_def->name, m_line_buffer, cmd_name_len) || m_line_buffer[cmd_name_len] != ' ') {
+        if (console->line_len < cmd_name_len + 1 || strncmp(cmd_def->name, console->line_buffer, cmd_name_len) || console->line_buffer[cmd_name_len] != ' ') {
             // current buffer doesn't start with this command
             continue;
         }
@@ -345,6 +1828,25 @@ static void do_tab_complete(void) {
             offset = cmd_name_len + 1;
             prefix += offset;
             prefix_length -= offset;
+        } else {
+            // complete the value of the last argument on the line if it's an enum or boolean
+            uint32_t arg_index = 0;
+            offset = cmd_name_len + 1;
+            for (uint32_t i = offset; i < console->line_len; i++) {
+                if (console->line_buffer[i] == ' ') {
+                    if (console->line_buffer[i - 1] != ' ') {
+                        arg_index++;
+                    }
+                    offset = i + 1;
+                }
+            }
+            if (arg_index >= cmd_def->num_args || !get_arg_values(&cmd_def->args[arg_index])) {
+                return;
+            }
+            m_tab_complete_values = get_arg_values(&cmd_def->args[arg_index]);
+            iter = value_tab_complete_iterator;
+            prefix += offset;
+            prefix_length -= offset;
         }
         break;
     }
@@ -369,63 +1871,109 @@ static void do_tab_complete(void) {
         }
         num_matches++;
     }
-    const uint32_t completion_length = longest_common_prefix - (m_line_len - offset);
-    if (num_matches == 0 || (num_matches == 1 && completion_length == 0)) {
-        // nothing to auto-complete
+    const uint32_t completion_length = longest_common_prefix - (console->line_len - offset);
+    if (num_matches == 0 || (num_matches == 1 && completion_length == 0) || console->line_len + completion_length >= CONSOLE_MAX_LINE_LENGTH) {
+        // nothing to auto-complete (or it wouldn't fit)
         return;
     }
 
-    move_cursor_to_end();
+    move_cursor_to_end(console);
     if (completion_length) {
         // auto complete the remaining common prefix
-        memcpy(&m_line_buffer[m_line_len], &first_tab_complete[m_line_len - offset], completion_length);
-        m_line_buffer[m_line_len + completion_length] = '\0';
-        write_str(&m_line_buffer[m_line_len]);
-        m_line_len += completion_length;
-        m_cursor_pos = m_line_len;
+        memcpy(&console->line_buffer[console->line_len], &first_tab_complete[console->line_len - offset], completion_length);
+        console->line_buffer[console->line_len + completion_length] = '\0';
+        write_str(console, &console->line_buffer[console->line_len]);
+        console->line_len += completion_length;
+        console->cursor_pos = console->line_len;
+        note_line_len(console);
     } else {
         // nothing left to auto complete so print all the potential matches in a new line
-        write_str(CONSOLE_NEWLINE);
+        write_str(console, CONSOLE_NEWLINE);
         for (const char* tab_complete = iter(true); tab_complete; tab_complete = iter(false)) {
             if (strncmp(tab_complete, prefix, prefix_length)) {
                 continue;
             }
             if (tab_complete != first_tab_complete) {
-                write_str(" ");
+                write_str(console, " ");
             }
-            write_str(tab_complete);
+            write_str(console, tab_complete);
         }
-        write_str(CONSOLE_NEWLINE);
+        write_str(console, CONSOLE_NEWLINE);
         // re-print the prompt and any valid, pending command
-        write_str(CONSOLE_PROMPT);
-        if (!m_line_invalid) {
-            write_str(m_line_buffer);
+        write_str(console, CONSOLE_PROMPT);
+        if (!console->line_invalid) {
+            write_str(console, console->line_buffer);
         }
     }
 }
 #endif
 
+#if CONSOLE_COMMAND_STATS
+// writes n right-aligned in a field of width characters
+static void write_uint_padded(console_t* console, uint32_t n, uint32_t width) {
+    uint32_t digits = 1;
+    for (uint32_t i = n; i >= 10; i /= 10) {
+        digits++;
+    }
+    if (width > digits) {
+        write_repeat(console, ' ', width - digits);
+    }
+    write_uint(console, n);
+}
+#endif
+
 #if CONSOLE_HELP_COMMAND
 #if CONSOLE_TAB_COMPLETE
 static const char* help_tab_complete_iterator(bool start) {
     return command_tab_complete_iterator(start);
 }
 #endif
+// writes which values an argument takes if it's not a plain integer or string
+static void write_arg_type_hint(console_t* console, const console_arg_def_t* arg_def) {
+    switch (arg_def->type) {
+        case CONSOLE_ARG_TYPE_UINT:
+            write_str(console, " (unsigned)");
+            break;
+        case CONSOLE_ARG_TYPE_HEX:
+            write_str(console, " (hex)");
+            break;
+        case CONSOLE_ARG_TYPE_BOOL:
+            write_str(console, " (on/off)");
+            break;
+        case CONSOLE_ARG_TYPE_ENUM:
+            for (uint32_t i = 0; arg_def->enum_values[i]; i++) {
+                write_str(console, i ? "|" : " (");
+                write_str(console, arg_def->enum_values[i]);
+            }
+            write_str(console, ")");
+            break;
+        case CONSOLE_ARG_TYPE_FIXED:
+            write_str(console, " (");
+            write_uint(console, arg_def->decimals);
+            write_str(console, " decimal places)");
+            break;
+        default:
+            break;
+    }
+}
+
 static void help_command_handler(const help_args_t* args) {
+    console_t* console = m_current;
     if (args->command != CONSOLE_STR_ARG_DEFAULT) {
         const console_command_def_t* cmd_def = get_command(args->command);
         if (!cmd_def) {
-            write_str("ERROR: Unknown command (");
-            write_str(args->command);
-            write_str(")"CONSOLE_NEWLINE);
+            write_str(console, "ERROR: Unknown command (");
+            write_str(console, args->command);
+            write_str(console, ")"CONSOLE_NEWLINE);
+            console->status = CONSOLE_STATUS_COMMAND_NOT_FOUND;
             return;
         }
         if (cmd_def->desc) {
-            write_str(cmd_def->desc);
-            write_str(CONSOLE_NEWLINE);
+            write_str(console, cmd_def->desc);
+            write_str(console, CONSOLE_NEWLINE);
         }
-        write_str("Usage: ");
-        write_str(args->command);
+        write_str(console, "Usage: ");
+        write_str(console, args->command);
         uint32_t max_name_len = 0;
         for (uint32_t i = 0; i < cmd_def->num_args; i++) {
             const console_arg_def_t* arg_def = &cmd_def->args[i];
@@ -434,33 +1982,37 @@ static void help_command_handler(const help_args_t* args) {
                 max_name_len = name_len;
             }
             if (arg_def->is_optional) {
-                write_str(" [");
+                write_str(console, " [");
             } else {
-                write_str(" ");
+                write_str(console, " ");
             }
-            write_str(cmd_def->args[i].name);
+            write_str(console, cmd_def->args[i].name);
             if (arg_def->is_optional) {
-                write_str("]");
+                write_str(console, "]");
+            }
+#if CONSOLE_STREAM_ARGS
+            if (arg_def->type == CONSOLE_ARG_TYPE_STREAM) {
+                write_str(console, "...");
             }
+#endif
         }
-        write_str(CONSOLE_NEWLINE);
+        write_str(console, CONSOLE_NEWLINE);
         for (uint32_t i = 0; i < cmd_def->num_args; i++) {
             const console_arg_def_t* arg_def = &cmd_def->args[i];
-            write_str("  ");
-            write_str(arg_def->name);
+            write_str(console, "  ");
+            write_str(console, arg_def->name);
             if (arg_def->desc) {
                 // pad the description so they all line up
                 const uint32_t name_len = strlen(arg_def->name);
-                for (uint32_t j = 0; j < max_name_len - name_len; j++) {
-                    write_str(" ");
-                }
-                write_str(" - ");
-                write_str(arg_def->desc);
+                write_repeat(console, ' ', max_name_len - name_len);
+                write_str(console, " - ");
+                write_str(console, arg_def->desc);
             }
-            write_str(CONSOLE_NEWLINE);
+            write_arg_type_hint(console, arg_def);
+            write_str(console, CONSOLE_NEWLINE);
         }
     } else {
-        write_str("Available commands:"CONSOLE_NEWLINE);
+        write_str(console, "Available commands:"CONSOLE_NEWLINE);
         // get the max name length for padding
         uint32_t max_name_len = 0;
         FOREACH_COMMAND(cmd_def) {
@@ -470,29 +2022,201 @@ static void help_command_handler(const help_args_t* args) {
             }
         }
         FOREACH_COMMAND(cmd_def) {
-            write_str("  ");
-            write_str(cmd_def->name);
+            write_str(console, "  ");
+            write_str(console, cmd_def->name);
             if (cmd_def->desc) {
                 // pad the description so they all line up
                 const uint32_t name_len = strlen(cmd_def->name);
-                for (uint32_t j = 0; j < max_name_len - name_len; j++) {
-                    write_str(" ");
-                }
-                write_str(" - ");
-                write_str(cmd_def->desc);
+                write_repeat(console, ' ', max_name_len - name_len);
+                write_str(console, " - ");
+                write_str(console, cmd_def->desc);
+            }
+            write_str(console, CONSOLE_NEWLINE);
+        }
+    }
+}
+#endif
+
+#if CONSOLE_BINARY_RPC
+static void rpcdesc_command_handler(void) {
+    console_t* console = m_current;
+    FOREACH_COMMAND(cmd_def) {
+        char hash_str[5];
+        const uint16_t hash = command_hash(cmd_def->name);
+        for (uint32_t i = 0; i < 4; i++) {
+            hash_str[i] = "0123456789abcdef"[(hash >> (12 - 4 * i)) & 0xf];
+        }
+        hash_str[4] = '\0';
+        write_str(console, hash_str);
+        write_str(console, " ");
+        write_str(console, cmd_def->name);
+        write_str(console, " ");
+        for (uint32_t i = 0; i < cmd_def->num_args; i++) {
+            // one letter per console_arg_type_t (lower case: required, upper case: optional)
+            // fixed-point arguments are followed by the number of decimal places
+            const console_arg_def_t* arg_def = &cmd_def->args[i];
+            char type_str[3] = {"iuxtefsb"[arg_def->type], '\0', '\0'};
+            if (arg_def->is_optional) {
+                type_str[0] += 'A' - 'a';
             }
-            write_str(CONSOLE_NEWLINE);
+            if (arg_def->type == CONSOLE_ARG_TYPE_FIXED) {
+                type_str[1] = '0' + arg_def->decimals;
+            }
+            write_str(console, type_str);
+        }
+        write_str(console, CONSOLE_NEWLINE);
+    }
+}
+#endif
+
+#if CONSOLE_MACHINE_MODE
+static void machine_command_handler(const machine_args_t* args) {
+    console_set_machine_mode(m_current, args->enable);
+}
+#endif
+
+#if CONSOLE_COMMAND_STATS
+static void cmdstats_command_handler(void) {
+    console_t* console = m_current;
+    write_str(console, "command      count   min us   max us  mean us    bytes"CONSOLE_NEWLINE);
+    for (uint32_t i = 0; i < m_num_commands; i++) {
+        const command_stats_t* stats = &m_command_stats[i];
+        const uint32_t name_len = strlen(m_commands[i].name);
+        if (!stats->count) {
+            continue;
         }
+        write_str(console, m_commands[i].name);
+        write_repeat(console, ' ', (name_len < 10) ? 10 - name_len : 0);
+        write_uint_padded(console, stats->count, 8);
+        write_uint_padded(console, cycles_to_us(console, stats->min_cycles), 9);
+        write_uint_padded(console, cycles_to_us(console, stats->max_cycles), 9);
+        write_uint_padded(console, cycles_to_us(console, (uint32_t)(stats->total_cycles / stats->count)), 9);
+        write_uint_padded(console, stats->output_bytes, 9);
+        write_str(console, CONSOLE_NEWLINE);
+    }
+    // this run of cmdstats is recorded after the reset
+    memset(m_command_stats, 0, sizeof(m_command_stats));
+}
+#endif
+
+#if CONSOLE_SCRIPT
+static void script_command_handler(const script_args_t* args) {
+    console_t* console = m_current;
+    console_script_t* prog = &console->script;
+    const console_stream_t* stream = args->source;
+    switch (stream->event) {
+        case CONSOLE_STREAM_START:
+            prog->code_len = 0;
+            prog->stmt_len = 0;
+            prog->depth = 0;
+            prog->error = NULL;
+            break;
+        case CONSOLE_STREAM_DATA:
+            // compile each statement as soon as it's complete
+            for (uint32_t i = 0; i < stream->length && !prog->error; i++) {
+                if (stream->data[i] == ';') {
+                    script_compile_pending(console);
+                } else if (prog->stmt_len < sizeof(prog->stmt) - 1) {
+                    prog->stmt[prog->stmt_len++] = stream->data[i];
+                } else {
+                    prog->stmt[prog->stmt_len] = '\0';
+                    prog->error = "Statement too long";
+                }
+            }
+            break;
+        case CONSOLE_STREAM_END:
+            if (!prog->error) {
+                script_compile_pending(console);
+            }
+            if (!prog->error && prog->depth) {
+                prog->error = "Missing end";
+            }
+            if (prog->error) {
+                write_str(console, "ERROR: ");
+                write_str(console, prog->error);
+                if (prog->stmt_len) {
+                    write_str(console, ": ");
+                    write_str(console, prog->stmt);
+                }
+                write_str(console, CONSOLE_NEWLINE);
+                prog->code_len = 0;
+                console->status = CONSOLE_STATUS_INVALID_ARGS;
+            } else {
+                write_uint(console, prog->code_len);
+                write_str(console, " bytes of bytecode"CONSOLE_NEWLINE);
+            }
+            break;
+        case CONSOLE_STREAM_ABORT:
+            prog->code_len = 0;
+            break;
+    }
+}
+
+static void run_command_handler(void) {
+    console_t* console = m_current;
+    console_script_t* prog = &console->script;
+#if CONSOLE_RESUMABLE
+    if (console_get_step() == CONSOLE_STEP_CANCEL) {
+        // Ctrl+C during a delay statement
+        write_str(console, "Interrupted"CONSOLE_NEWLINE);
+        console->status = CONSOLE_STATUS_INTERRUPTED;
+        prog->running = false;
+        return;
+    } else if (console_get_step() == CONSOLE_STEP_RESUME) {
+        console->status = script_run(console);
+        prog->running = console->yielded;
+        return;
+    }
+#endif
+    if (prog->running) {
+        write_str(console, "ERROR: The script is already running"CONSOLE_NEWLINE);
+        console->status = CONSOLE_STATUS_INVALID_ARGS;
+        return;
+    } else if (!prog->code_len) {
+        write_str(console, "ERROR: No script compiled"CONSOLE_NEWLINE);
+        console->status = CONSOLE_STATUS_INVALID_ARGS;
+        return;
+    }
+    prog->running = true;
+    prog->pc = 0;
+    memset(prog->vars, 0, sizeof(prog->vars));
+    if (console->init.interrupted_function) {
+        console->init.interrupted_function(true);
     }
+    console->status = script_run(console);
+#if CONSOLE_RESUMABLE
+    prog->running = console->yielded;
+#else
+    prog->running = false;
+#endif
 }
 #endif
 
-void console_init(const console_init_t* init) {
-    m_init = *init;
+void console_init(console_t* console, const console_init_t* init) {
+    memset(console, 0, sizeof(*console));
+    console->init = *init;
+#if CONSOLE_HISTORY
+    console->history_pos = HISTORY_NONE;
+#endif
+    // the built-in commands are shared by all instances (registering them again is rejected as a duplicate)
 #if CONSOLE_HELP_COMMAND
     console_command_register(help);
 #endif
-    write_str(CONSOLE_NEWLINE CONSOLE_PROMPT);
+#if CONSOLE_MACHINE_MODE
+    console_command_register(machine);
+#endif
+#if CONSOLE_BINARY_RPC
+    console_command_register(rpcdesc);
+#endif
+#if CONSOLE_COMMAND_STATS
+    console_command_register(cmdstats);
+#endif
+#if CONSOLE_SCRIPT
+    console_command_register(script);
+    console_command_register(run);
+#endif
+    write_str(console, CONSOLE_NEWLINE CONSOLE_PROMPT);
+    flush_output(console);
 }
 
 bool console_command_register(const console_command_def_t* cmd) {
@@ -500,12 +2224,12 @@ bool console_command_register(const console_command_def_t* cmd) {
         return false;
     }
     // validate the command
-    if (!cmd->name || !cmd->handler || strlen(cmd->name) >= CONSOLE_MAX_LINE_LENGTH) {
+    if (!cmd->name || !cmd->handler || strlen(cmd->name) >= CONSOLE_MAX_LINE_LENGTH || cmd->num_args > CONSOLE_MAX_ARGS) {
         return false;
     }
     // validate the arguments
     for (uint32_t i = 0; i < cmd->num_args; i++) {
-        if (!validate_arg_def(cmd->args, i + 1 == cmd->num_args)) {
+        if (!validate_arg_def(&cmd->args[i], i + 1 == cmd->num_args)) {
             return false;
         }
     }
@@ -513,175 +2237,478 @@ bool console_command_register(const console_command_def_t* cmd) {
     if (get_command(cmd->name)) {
         return false;
     }
+#if CONSOLE_BINARY_RPC
+    // RPC requests address commands by hash, so it must be unique as well
+    if (get_command_by_hash(command_hash(cmd->name))) {
+        return false;
+    }
+#endif
     // add the command
     m_commands[m_num_commands++] = *cmd;
     return true;
 }
 
-void console_process(const uint8_t* data, uint32_t length) {
 #if CONSOLE_FULL_CONTROL
-    const char* echo_str = NULL;
-    for (uint32_t i = 0; i < length; i++) {
-        const char c = data[i];
-        if (m_escape_sequence_index == 0 && c == '\x1b') {
-            // start of an escape sequence
-            m_escape_sequence_index++;
-            continue;
-        } else if (m_escape_sequence_index == 1) {
+#if CONSOLE_HISTORY
+static void recall_history(console_t* console, bool older) {
+    if (older) {
+        if (console->history_pos == HISTORY_NONE && console->history_used) {
+            console->history_pos = history_prev(console, console->history_tail);
+        } else if (console->history_pos != HISTORY_NONE && console->history_pos != console->history_head) {
+            console->history_pos = history_prev(console, console->history_pos);
+        } else {
+            return;
+        }
+    } else {
+        if (console->history_pos == HISTORY_NONE) {
+            return;
+        }
+        console->history_pos = history_next(console, console->history_pos);
+        if (console->history_pos == console->history_tail) {
+            console->history_pos = HISTORY_NONE;
+        }
+    }
+    const uint32_t old_len = console->line_len;
+    uint32_t common = 0;
+    if (console->history_pos == HISTORY_NONE) {
+        console->line_buffer[0] = '\0';
+        console->line_len = 0;
+    } else {
+        common = history_common_prefix(console, console->history_pos);
+        history_copy_out(console, console->history_pos, console->line_buffer);
+        console->line_len = console->history_arena[console->history_pos];
+    }
+    console->line_invalid = false;
+    redraw_line(console, common, old_len);
+}
+#endif
+
+// handles the final byte of a CSI (ESC [ ...) or SS3 (ESC O x) sequence
+static void process_escape_sequence(console_t* console, char final) {
+    const uint32_t count = console->csi_params[0] ? console->csi_params[0] : 1;
+    // xterm-style modifiers: 1 + (shift:1 | alt:2 | ctrl:4)
+    const bool word_jump = (console->csi_num_params > 1) && ((console->csi_params[1] - 1) & 6);
+    switch (final) {
+#if CONSOLE_HISTORY
+        case 'A':
+            // up arrow
+            recall_history(console, true);
+            break;
+        case 'B':
+            // down arrow
+            recall_history(console, false);
+            break;
+#endif
+        case 'C':
+            // right arrow
+            move_cursor_to(console, word_jump ? word_end_after_cursor(console) : console->cursor_pos + count);
+            break;
+        case 'D':
+            // left arrow
+            move_cursor_to(console, word_jump ? word_start_before_cursor(console) : (count < console->cursor_pos) ? console->cursor_pos - count : 0);
+            break;
+        case 'H':
+            move_cursor_to(console, 0);
+            break;
+        case 'F':
+            move_cursor_to(console, console->line_len);
+            break;
+        case '~':
+            // VT220-style editing keys
+            switch (console->csi_params[0]) {
+                case 1:
+                case 7:
+                    move_cursor_to(console, 0);
+                    break;
+                case 3:
+                    if (!console->line_invalid) {
+                        delete_at_cursor(console);
+                    }
+                    break;
+                case 4:
+                case 8:
+                    move_cursor_to(console, console->line_len);
+                    break;
+            }
+            break;
+    }
+}
+
+static void process_escape_char(console_t* console, char c) {
+    switch (console->escape_state) {
+        case ESC_STATE_START:
+            memset(console->csi_params, 0, sizeof(console->csi_params));
+            console->csi_num_params = 0;
+            console->escape_state = ESC_STATE_NONE;
             if (c == '[') {
-                m_escape_sequence_index++;
-            } else {
-                // invalid escape sequence
-                m_escape_sequence_index = 0;
+                console->escape_state = ESC_STATE_CSI;
+            } else if (c == 'O') {
+                console->escape_state = ESC_STATE_SS3;
+            } else if (c == 'b') {
+                // meta+b
+                move_cursor_to(console, word_start_before_cursor(console));
+            } else if (c == 'f') {
+                // meta+f
+                move_cursor_to(console, word_end_after_cursor(console));
             }
-            continue;
-        } else if (m_escape_sequence_index == 2) {
-            // process the command
-            m_escape_sequence_index = 0;
-            if (c == 'C') {
-                // right arrow
-                if (m_cursor_pos < m_line_len) {
-                    const char str[2] = {m_line_buffer[m_cursor_pos], '\0'};
-                    write_str(str);
-                    m_cursor_pos++;
-                }
-            } else if (c == 'D') {
-                // left arrow
-                if (m_cursor_pos) {
-                    write_str("\b");
-                    m_cursor_pos--;
+            break;
+        case ESC_STATE_CSI:
+            if (c >= '0' && c <= '9') {
+                if (!console->csi_num_params) {
+                    console->csi_num_params = 1;
                 }
-            }
-#if CONSOLE_HISTORY
-            bool update_line_from_history = false;
-            if (c == 'A') {
-                // up arrow
-                if (m_history_index + 1 < (int32_t)m_history_len) {
-                    m_history_index++;
-                    update_line_from_history = true;
+                uint32_t* param = &console->csi_params[console->csi_num_params - 1];
+                if (console->csi_num_params <= CONSOLE_CSI_MAX_PARAMS && *param < CSI_MAX_VALUE) {
+                    *param = *param * 10 + (c - '0');
                 }
-            } else if (c == 'B') {
-                // down arrow
-                if (m_history_index > -1) {
-                    m_history_index--;
-                    update_line_from_history = true;
+            } else if (c == ';') {
+                // an omitted first parameter still counts
+                console->csi_num_params = console->csi_num_params ? console->csi_num_params + 1 : 2;
+                if (console->csi_num_params > CONSOLE_CSI_MAX_PARAMS) {
+                    // ignore any extra parameters
+                    console->csi_num_params = CONSOLE_CSI_MAX_PARAMS + 1;
                 }
+            } else if (c >= 0x40 && c <= 0x7e) {
+                console->escape_state = ESC_STATE_NONE;
+                process_escape_sequence(console, c);
+            } else if (c < 0x20 || c > 0x7e) {
+                // control characters abort the sequence, private/intermediate bytes are ignored
+                console->escape_state = ESC_STATE_NONE;
             }
-            if (update_line_from_history) {
-                const char* history_line = (m_history_index == -1) ? "" : m_history_buffer[(m_history_start_index + m_history_len - m_history_index) % CONSOLE_HISTORY];
-                erase_current_line(strlen(history_line));
-                strcpy(m_line_buffer, history_line);
-                m_line_len = strlen(m_line_buffer);
-                m_cursor_pos = m_line_len;
-                write_str(CONSOLE_PROMPT);
-                write_str(m_line_buffer);
-            }
+            break;
+        case ESC_STATE_SS3:
+            console->escape_state = ESC_STATE_NONE;
+            process_escape_sequence(console, c);
+            break;
+        default:
+            console->escape_state = ESC_STATE_NONE;
+            break;
+    }
+}
+#endif
+
+#if CONSOLE_MACHINE_MODE || !CONSOLE_FULL_CONTROL
+// processes received data without echo or line editing - returns the number of bytes consumed
+static uint32_t process_raw(console_t* console, const uint8_t* data, uint32_t length) {
+    for (uint32_t i = 0; i < length; i++) {
+        const char c = data[i];
+#if CONSOLE_STREAM_ARGS
+        if (console->stream_state != STREAM_STATE_NONE) {
+            i += process_stream_data(console, &data[i], length - i) - 1;
+            continue;
+        }
 #endif
+#if CONSOLE_BINARY_RPC
+        if (console->rpc_state != RPC_STATE_IDLE) {
+            i += process_rpc_data(console, &data[i], length - i) - 1;
+            continue;
+        } else if (c == CHAR_SOH && !console->line_len && console->machine_mode && console->init.write_binary_function) {
+            // start of a binary RPC request
+            console->rpc_state = RPC_STATE_LENGTH;
+            console->rpc_escape = false;
             continue;
         }
+#endif
         if (c == CONSOLE_RETURN_KEY) {
-            if (echo_str) {
-                write_str(echo_str);
-                echo_str = NULL;
-            }
-            write_str(CONSOLE_NEWLINE);
-            process_line();
-            reset_line_and_print_prompt();
-        } else if (c == CHAR_CTRL_C) {
-            if (echo_str) {
-                write_str(echo_str);
-                echo_str = NULL;
-            }
-            write_str(CONSOLE_NEWLINE);
-            reset_line_and_print_prompt();
-            echo_str = NULL;
-        } else if (!m_line_invalid && c == '\b') {
-            if (echo_str) {
-                write_str(echo_str);
-                echo_str = NULL;
-            }
-            if (m_cursor_pos) {
-                write_str("\b \b");
-                if (m_cursor_pos != m_line_len) {
-                    // shift all the characters in the line down
-                    memmove(&m_line_buffer[m_cursor_pos-1], &m_line_buffer[m_cursor_pos], m_line_len - m_cursor_pos);
-                }
-                m_cursor_pos--;
-                m_line_len--;
-                m_line_buffer[m_line_len] = '\0';
-                if (m_cursor_pos != m_line_len) {
-                    write_str(&m_line_buffer[m_cursor_pos]);
-                    write_str(" ");
-                    for (uint32_t j = 0; j < m_line_len - m_cursor_pos + 1; j++) {
-                        write_str("\b");
-                    }
-                }
+            process_line(console);
+            if (command_pending(console)) {
+                // the rest is processed once the command is done
+                return i + 1;
             }
-#if CONSOLE_TAB_COMPLETE
-        } else if (!m_line_invalid && c == '\t') {
-            if (echo_str) {
-                write_str(echo_str);
-                echo_str = NULL;
-            }
-            do_tab_complete();
-#endif
-        } else if (!m_line_invalid && c >= ' ' && c <= '~') {
-            // valid character
-            if (m_cursor_pos != m_line_len) {
-                if (echo_str) {
-                    write_str(echo_str);
-                    echo_str = NULL;
-                }
-                const uint32_t prev_cursor_pos = m_cursor_pos;
-                push_char(c);
-                write_str(&m_line_buffer[prev_cursor_pos]);
-                for (uint32_t j = 0; j < m_line_len - m_cursor_pos; j++) {
-                    write_str("\b");
-                }
-            } else {
-                if (!echo_str) {
-                    // FIXME for m_cursor_pos != m_line_len
-                    echo_str = &m_line_buffer[m_line_len];
-                }
-                push_char(c);
+            reset_line_and_print_prompt(console);
+#if CONSOLE_MACHINE_MODE && CONSOLE_FULL_CONTROL
+            if (!console->machine_mode) {
+                // just switched back to interactive mode, so the rest gets echoed and edited again
+                return i + 1 + console_process(console, &data[i + 1], length - i - 1);
             }
+#endif
+        } else if (!console->line_invalid && is_printable(c)) {
+            // valid characters
+            const uint32_t run_length = printable_run_length(&data[i], length - i);
+            insert_chars(console, &data[i], run_length);
+            i += run_length - 1;
+#if CONSOLE_STREAM_ARGS
+            check_stream_start(console);
+#endif
+        } else {
+            console->line_invalid = true;
         }
     }
-    if (echo_str) {
-        write_str(echo_str);
+    return length;
+}
+#endif
+
+#if CONSOLE_RESUMABLE
+// calls the handler of the yielded command once more and finishes its line if it's done
+static void resume_command(console_t* console) {
+    call_handler(console, console->resume_cmd);
+    if (console->yielded) {
+        return;
     }
-#else
+    console->resume_cmd = NULL;
+    finish_line(console, console->resume_framed);
+    reset_line_and_print_prompt(console);
+    flush_output(console);
+}
+#endif
+
+uint32_t console_line_peak(const console_t* console) {
+    return console->line_len_max;
+}
+
+uint32_t console_process(console_t* console, const uint8_t* data, uint32_t length) {
+    uint32_t consumed = length;
+#if CONSOLE_RESUMABLE
+    if (console->resume_cmd) {
+        // no input while a command is busy, except Ctrl+C which cancels it (and drops what was typed ahead of it)
+        const uint8_t* const ctrl_c = memchr(data, CHAR_CTRL_C, length);
+        if (ctrl_c) {
+            console_cancel(console);
+            return (uint32_t)(ctrl_c - data) + 1;
+        } else if (!console->wait_input || !length) {
+            return 0;
+        }
+        // ... or for the command itself, if it waits for input - what it doesn't take stays for the console
+        console->input = data;
+        console->input_len = length;
+        console->step = CONSOLE_STEP_RESUME;
+        resume_command(console);
+        consumed = length - console->input_len;
+        console->input = NULL;
+        console->input_len = 0;
+        return consumed;
+    }
+#endif
+#if CONSOLE_MACHINE_MODE
+    if (console->machine_mode) {
+        // no echo, editing, history or tab completion
+        consumed = process_raw(console, data, length);
+        flush_output(console);
+        return consumed;
+    }
+#endif
+#if CONSOLE_FULL_CONTROL
     for (uint32_t i = 0; i < length; i++) {
         const char c = data[i];
+#if CONSOLE_STREAM_ARGS
+        if (console->stream_state != STREAM_STATE_NONE) {
+            i += process_stream_data(console, &data[i], length - i) - 1;
+            continue;
+        }
+#endif
+        if (console->escape_state != ESC_STATE_NONE) {
+            process_escape_char(console, c);
+            continue;
+        } else if (c == CHAR_ESC) {
+            // start of an escape sequence
+            console->escape_state = ESC_STATE_START;
+            continue;
+        }
         if (c == CONSOLE_RETURN_KEY) {
-            process_line();
-            reset_line_and_print_prompt();
-        } else if (!m_line_invalid && c >= ' ' && c <= '~') {
-            // valid character
-            push_char(c);
-        } else {
-            m_line_invalid = true;
+            write_str(console, CONSOLE_NEWLINE);
+            process_line(console);
+            if (command_pending(console)) {
+                // the rest is processed once the command is done
+                consumed = i + 1;
+                break;
+            }
+            reset_line_and_print_prompt(console);
+#if CONSOLE_MACHINE_MODE
+            if (console->machine_mode) {
+                // just switched to machine mode, so the rest must not be echoed
+                consumed = i + 1 + process_raw(console, &data[i + 1], length - i - 1);
+                break;
+            }
+#endif
+        } else if (c == CHAR_CTRL_C) {
+            write_str(console, CONSOLE_NEWLINE);
+            reset_line_and_print_prompt(console);
+        } else if (!console->line_invalid && c == '\b') {
+            if (console->cursor_pos) {
+                write_str(console, "\b");
+                console->cursor_pos--;
+                delete_at_cursor(console);
+            }
+#if CONSOLE_TAB_COMPLETE
+        } else if (!console->line_invalid && c == '\t') {
+            do_tab_complete(console);
+#endif
+        } else if (is_printable(c)) {
+            // insert and echo the whole run of valid characters (e.g. pasted text) at once
+            const uint32_t run_length = printable_run_length(&data[i], length - i);
+            if (!console->line_invalid) {
+                const uint32_t prev_cursor_pos = console->cursor_pos;
+                insert_chars(console, &data[i], run_length);
+                write_str(console, &console->line_buffer[prev_cursor_pos]);
+                cursor_left(console, console->line_len - console->cursor_pos);
+#if CONSOLE_STREAM_ARGS
+                check_stream_start(console);
+#endif
+            }
+            i += run_length - 1;
         }
     }
+    flush_output(console);
+#else
+    consumed = process_raw(console, data, length);
+    flush_output(console);
+#endif
+    return consumed;
+}
+
+#if CONSOLE_RESUMABLE
+void console_yield(void) {
+    console_yield_for(0);
+}
+
+void console_yield_for(uint32_t ms) {
+    if (m_current && m_current->step != CONSOLE_STEP_CANCEL) {
+        m_current->yielded = true;
+        m_current->wait_input = false;
+        m_current->resume_delay_ms = ms;
+    }
+}
+
+uint32_t console_resume_delay(const console_t* console) {
+    return console->resume_cmd ? console->resume_delay_ms : 0;
+}
+
+void console_yield_for_input(void) {
+    if (m_current && m_current->step != CONSOLE_STEP_CANCEL) {
+        m_current->yielded = true;
+        m_current->wait_input = true;
+        m_current->resume_delay_ms = 0;
+    }
+}
+
+uint32_t console_read_input(uint8_t* data, uint32_t max) {
+    if (!m_current) {
+        return 0;
+    }
+    const uint32_t length = (m_current->input_len < max) ? m_current->input_len : max;
+    memcpy(data, m_current->input, length);
+    m_current->input += length;
+    m_current->input_len -= length;
+    return length;
+}
+
+bool console_waiting_for_input(const console_t* console) {
+    return console->resume_cmd && console->wait_input;
+}
+
+console_step_t console_get_step(void) {
+    return m_current ? m_current->step : CONSOLE_STEP_START;
+}
+
+bool console_busy(const console_t* console) {
+    return console->resume_cmd != NULL;
+}
+
+bool console_poll(console_t* console) {
+    if (!console->resume_cmd) {
+        return false;
+    } else if (console->wait_input) {
+        // called by console_process() once there's input
+        return true;
+    }
+    console->step = CONSOLE_STEP_RESUME;
+    resume_command(console);
+    return console->resume_cmd != NULL;
+}
+
+void console_cancel(console_t* console) {
+    if (!console->resume_cmd) {
+        return;
+    }
+    console->step = CONSOLE_STEP_CANCEL;
+    console->status = CONSOLE_STATUS_INTERRUPTED;
+    resume_command(console);
+}
+#endif
+
+console_t* console_get_current(void) {
+    return m_current;
+}
+
+void console_set_status(int32_t status) {
+    if (m_current) {
+        m_current->status = status;
+    }
+}
+
+void console_write_data(const char* data, uint32_t length) {
+    if (m_current) {
+        write_chars(m_current, data, length);
+    }
+}
+
+#if CONSOLE_COMMAND_STATS
+void console_count_output(uint32_t length) {
+    if (m_current) {
+        m_current->output_bytes += length;
+    }
+}
 #endif
+
+#if CONSOLE_BINARY_RPC
+bool console_rpc_active(void) {
+    return m_current && m_current->rpc_active;
+}
+#endif
+
+#if CONSOLE_MACHINE_MODE
+void console_set_machine_mode(console_t* console, bool enable) {
+    console->machine_mode = enable;
+}
+
+bool console_get_machine_mode(const console_t* console) {
+    return console->machine_mode;
+}
+
+bool console_frame_active(void) {
+    return m_current && m_current->in_frame;
 }
+#endif
 
 #if CONSOLE_FULL_CONTROL
-void console_print_line(const char* str) {
-    // erase any characters which would end up still showing after the end line
-    erase_current_line(strlen(str));
-    // print the line
-    write_str(str);
-    if (!m_is_active) {
-        // re-print the prompt and any valid, pending command
-        write_str(CONSOLE_PROMPT);
-        if (!m_line_invalid) {
-            write_str(m_line_buffer);
+void console_print_line(console_t* console, const char* str) {
+#if CONSOLE_MACHINE_MODE
+    if (console->machine_mode) {
+        // no prompt or line to redraw, and hosts skip anything between frames. between polls of a resumable
+        // command, the console is made current so the line gets escaped as part of the command's frame
+        console_t* const prev_current = m_current;
+        if (console->in_frame) {
+            m_current = console;
+        }
+        write_str(console, str);
+        flush_output(console);
+        m_current = prev_current;
+        return;
+    }
+#endif
+    const bool prompt_shown = !console->is_active && !command_pending(console);
+    // the first line of str overwrites the prompt line in place, so only what it doesn't cover needs erasing -
+    // unless the contents of the line aren't known (command output, or an invalid line)
+    const char* const newline = strchr(str, '\n');
+    const uint32_t first_len = newline ? (uint32_t)(newline - str) : strlen(str);
+    write_str(console, "\r");
+    write_chars(console, str, first_len);
+    if (!prompt_shown || console->line_invalid || first_len < sizeof(CONSOLE_PROMPT) - 1 + console->line_len) {
+        erase_to_end_of_line(console);
+    }
+    write_str(console, &str[first_len]);
+    if (prompt_shown) {
+        // re-print the prompt and any valid, pending command on the new line
+        write_str(console, CONSOLE_PROMPT);
+        if (!console->line_invalid) {
+            const uint32_t cursor_pos = console->cursor_pos;
+            console->cursor_pos = 0;
+            redraw_line(console, 0, 0);
             // fix the cursor position if needed
-            for (uint32_t i = 0; i < m_line_len - m_cursor_pos; i++) {
-                write_str("\b");
-            }
+            cursor_left(console, console->line_len - cursor_pos);
+            console->cursor_pos = cursor_pos;
         }
     }
+    flush_output(console);
 }
 #endif
@@ -7,8 +7,16 @@
 #include <stdbool.h>
 
 #define CONSOLE_INT_ARG_DEFAULT ((intptr_t)-1)
+#define CONSOLE_UINT_ARG_DEFAULT ((uintptr_t)-1)
+#define CONSOLE_FIXED_ARG_DEFAULT ((intptr_t)INT32_MIN)
 #define CONSOLE_STR_ARG_DEFAULT ((const char*)NULL)
 
+// The maximum number of arguments of a command (limited by the CONSOLE_COMMAND_DEF() macros)
+#define CONSOLE_MAX_ARGS 10
+
+// The number of parameters of an escape sequence which are kept (e.g. "ESC[1;5C"), any more are ignored
+#define CONSOLE_CSI_MAX_PARAMS 2
+
 // Generic command handler type which is used internally by the console library
 typedef void(*console_command_handler_t)(const void*);
 typedef void(*console_command_handler_no_args_t)(void);
@@ -17,13 +25,72 @@ typedef void(*console_command_handler_no_args_t)(void);
 typedef const char*(*console_tab_complete_iterator_t)(bool);
 #endif
 
+// Command status as reported in machine mode (negative values are used by the console library itself)
+typedef enum {
+    CONSOLE_STATUS_SUCCESS = 0,
+    // The line was too long or contained invalid characters or whitespace
+    CONSOLE_STATUS_INVALID_LINE = -1,
+    // No command with this name is registered
+    CONSOLE_STATUS_COMMAND_NOT_FOUND = -2,
+    // Wrong number of arguments or an argument failed to parse
+    CONSOLE_STATUS_INVALID_ARGS = -3,
+    // A script was stopped by the interrupted function, or a resumable command was cancelled
+    CONSOLE_STATUS_INTERRUPTED = -4,
+} console_status_t;
+
 typedef enum {
-    // An integer argument (of type "intptr_t")
+    // An integer argument (of type "intptr_t") as accepted by strtol(str, NULL, 0): decimal, hex with a "0x" prefix or
+    // octal with a leading '0' (e.g. "010" is 8), optionally with a sign
     CONSOLE_ARG_TYPE_INT,
+    // An unsigned 32-bit argument (of type "uintptr_t"), decimal, hex with a "0x" prefix or octal with a leading '0'
+    CONSOLE_ARG_TYPE_UINT,
+    // An unsigned 32-bit argument (of type "uintptr_t") given in hex, with or without a "0x" prefix
+    CONSOLE_ARG_TYPE_HEX,
+    // A boolean argument (of type "intptr_t" - 0 or 1), given as 0/1, off/on, no/yes or false/true
+    CONSOLE_ARG_TYPE_BOOL,
+    // One of a table of names (of type "intptr_t" - the index into the table)
+    CONSOLE_ARG_TYPE_ENUM,
+    // A fixed-point decimal argument (of type "intptr_t" - the value multiplied by 10^decimals), e.g. "-1.5"
+    CONSOLE_ARG_TYPE_FIXED,
     // A string argument
     CONSOLE_ARG_TYPE_STR,
+#if CONSOLE_STREAM_ARGS
+    // The rest of the input, passed to the handler as it arrives (of type "const console_stream_t*")
+    CONSOLE_ARG_TYPE_STREAM,
+#endif
 } console_arg_type_t;
 
+#if CONSOLE_STREAM_ARGS
+typedef enum {
+    // The arguments before the stream are parsed, no data yet
+    CONSOLE_STREAM_START,
+    // The next chunk of data is in data/length
+    CONSOLE_STREAM_DATA,
+    // The input line ended, so there is no more data
+    CONSOLE_STREAM_END,
+    // The input was aborted with Ctrl+C
+    CONSOLE_STREAM_ABORT,
+} console_stream_event_t;
+
+// Passed as the streamed argument - the handler is called once for each event, with the same other arguments
+typedef struct {
+    console_stream_event_t event;
+    const uint8_t* data;
+    uint32_t length;
+} console_stream_t;
+#endif
+
+#if CONSOLE_RESUMABLE
+typedef enum {
+    // The first call of the handler, with the parsed arguments
+    CONSOLE_STEP_START,
+    // Called again (with the same arguments) after it yielded
+    CONSOLE_STEP_RESUME,
+    // The last call, after console_cancel() - yielding has no effect
+    CONSOLE_STEP_CANCEL,
+} console_step_t;
+#endif
+
 typedef struct {
     // The name of the argument
     const char* name;
@@ -35,6 +102,12 @@ typedef struct {
     console_arg_type_t type;
     // Whether or not the arg is optional (can ONLY be set for the last argument)
     bool is_optional;
+    union {
+        // The NULL-terminated table of names of an enum argument
+        const char* const* enum_values;
+        // The number of decimal places of a fixed-point argument (0-9)
+        uint32_t decimals;
+    };
 } console_arg_def_t;
 
 typedef struct {
@@ -57,15 +130,141 @@ typedef struct {
     const console_arg_def_t* args;
     // The number of arguments
     uint32_t num_args;
-    // A pointer which the console library uses internally to store arguments for this command
-    void** args_ptr;
 } console_command_def_t;
 
 typedef struct {
     // Write function which gets passed a string to be written out
     void(*write_function)(const char* str);
+    // Optional function which is called after each command handler, e.g. to flush buffered stdio output
+    void(*flush_function)(void);
+#if CONSOLE_BINARY_RPC
+    // Write function for binary data without any newline translation (binary RPC is disabled if NULL)
+    void(*write_binary_function)(const uint8_t* data, uint32_t length);
+#endif
+#if CONSOLE_COMMAND_STATS
+    // Optional function which returns a free-running cycle counter, to measure how long commands take
+    uint32_t(*cycles_function)(void);
+    // The frequency of the cycle counter in MHz, to convert cycles to microseconds
+    uint32_t cycles_per_us;
+#endif
+#if CONSOLE_SCRIPT || CONSOLE_RESUMABLE
+    // Optional function which sleeps for the given number of milliseconds (scripts can't use "delay" if NULL)
+    // It also waits out console_yield_for() of resumable commands which run via binary RPC or from scripts
+    void(*delay_function)(uint32_t ms);
+    // Optional function which returns true if a running script or a resumable command run via binary RPC or from a
+    // script should be stopped, e.g. after Ctrl+C
+    // It's called with clear set when a script or an RPC request starts, to discard an interrupt which happened before
+    bool(*interrupted_function)(bool clear);
+#endif
 } console_init_t;
 
+#if CONSOLE_SCRIPT
+// A loop or conditional which is still open while compiling a script (internal to the console library)
+typedef struct {
+    uint8_t kind;
+    uint16_t start;
+    uint16_t jump;
+    uint16_t breaks;
+} console_script_block_t;
+
+// The compiled script of a console instance (internal to the console library)
+typedef struct {
+    uint8_t code[CONSOLE_SCRIPT_SIZE];
+    uint32_t code_len;
+    // the statement which is being received
+    char stmt[CONSOLE_MAX_LINE_LENGTH];
+    uint32_t stmt_len;
+    // the first error while compiling (the statement is kept, to be reported when the source is complete)
+    const char* error;
+    bool running;
+    // where a running script continues after it yielded in a delay statement
+    uint32_t pc;
+    // the loops and conditionals which are still open while compiling
+    console_script_block_t blocks[CONSOLE_SCRIPT_MAX_DEPTH];
+    uint32_t depth;
+    // a-z, the status of the last command and one loop counter per nesting level
+    int32_t vars[26 + 1 + CONSOLE_SCRIPT_MAX_DEPTH];
+} console_script_t;
+#endif
+
+// The state of one console instance (e.g. one per serial port) - all instances share the registered commands
+// The fields are internal to the console library and must not be accessed directly
+typedef struct console {
+    console_init_t init;
+    // The parsed arguments of the command which is being run
+    void* args[CONSOLE_MAX_ARGS];
+    char line_buffer[CONSOLE_MAX_LINE_LENGTH];
+    uint32_t line_len;
+    uint32_t line_len_max;
+    uint32_t cursor_pos;
+    bool line_invalid;
+    bool is_active;
+    int32_t status;
+#if CONSOLE_MACHINE_MODE
+    bool machine_mode;
+    uint32_t frame_seq;
+    // between the STX and ETX of a frame, where output is escaped
+    bool in_frame;
+#endif
+#if CONSOLE_BINARY_RPC
+    uint8_t rpc_state;
+    // the previous request byte was a DLE
+    bool rpc_escape;
+    // set while a handler runs on behalf of an RPC request, so its output is sent as reply packets
+    bool rpc_active;
+    uint32_t rpc_len;
+    uint32_t rpc_received;
+#endif
+    // output is staged here and handed to the write function in one piece
+    char out_buffer[CONSOLE_OUTPUT_BUFFER_SIZE + 1];
+    uint32_t out_len;
+#if CONSOLE_COMMAND_STATS
+    // bytes written by command handlers (see console_count_output())
+    uint32_t output_bytes;
+    // the line started with the "time" prefix, so its command is being measured
+    bool timed;
+    uint32_t time_start_cycles;
+    uint32_t time_start_bytes;
+#endif
+#if CONSOLE_RESUMABLE
+    // the command of the current line which yielded, to be continued by console_poll()
+    const console_command_def_t* resume_cmd;
+    uint8_t step;
+    bool yielded;
+    // how long the yielded command asked to wait before its next call
+    uint32_t resume_delay_ms;
+    // the yielded command waits for input, which is passed to it while console_process() runs
+    bool wait_input;
+    const uint8_t* input;
+    uint32_t input_len;
+    // the line's response is a machine mode frame
+    bool resume_framed;
+#endif
+#if CONSOLE_STREAM_ARGS
+    uint8_t stream_state;
+    const console_command_def_t* stream_cmd;
+    console_stream_t stream;
+#endif
+#if CONSOLE_SCRIPT
+    console_script_t script;
+#endif
+#if CONSOLE_FULL_CONTROL
+    uint8_t escape_state;
+    uint8_t csi_num_params;
+    uint32_t csi_params[CONSOLE_CSI_MAX_PARAMS];
+#endif
+#if CONSOLE_HISTORY
+    // history entries are stored back-to-back in a ring arena as <len> <chars...> <len>
+    // the trailing length allows stepping backwards from any entry in O(1)
+    uint8_t history_arena[CONSOLE_HISTORY_SIZE];
+    uint32_t history_head;
+    uint32_t history_tail;
+    uint32_t history_used;
+    // offset of the entry currently recalled, or UINT32_MAX for the (empty) new line
+    uint32_t history_pos;
+#endif
+} console_t;
+
 // Defines a console command
 #if CONSOLE_HELP_COMMAND
 #define CONSOLE_COMMAND_DEF(CMD, DESC, ...) _CONSOLE_COMMAND_DEF(CMD, DESC, ##__VA_ARGS__)
@@ -81,44 +280,247 @@ typedef struct {
 
 // Defines an integer argument of a console command
 #if CONSOLE_HELP_COMMAND
-#define CONSOLE_INT_ARG_DEF(NAME, DESC) (NAME, CONSOLE_ARG_TYPE_INT, false, intptr_t, DESC)
+#define CONSOLE_INT_ARG_DEF(NAME, DESC) (NAME, CONSOLE_ARG_TYPE_INT, false, intptr_t, .enum_values = NULL, DESC)
 #else
-#define CONSOLE_INT_ARG_DEF(NAME) (NAME, CONSOLE_ARG_TYPE_INT, false, intptr_t)
+#define CONSOLE_INT_ARG_DEF(NAME) (NAME, CONSOLE_ARG_TYPE_INT, false, intptr_t, .enum_values = NULL)
 #endif
 
 // Defines a string argument of a console command
 #if CONSOLE_HELP_COMMAND
-#define CONSOLE_STR_ARG_DEF(NAME, DESC) (NAME, CONSOLE_ARG_TYPE_STR, false, const char*, DESC)
+#define CONSOLE_STR_ARG_DEF(NAME, DESC) (NAME, CONSOLE_ARG_TYPE_STR, false, const char*, .enum_values = NULL, DESC)
 #else
-#define CONSOLE_STR_ARG_DEF(NAME) (NAME, CONSOLE_ARG_TYPE_STR, false, const char*)
+#define CONSOLE_STR_ARG_DEF(NAME) (NAME, CONSOLE_ARG_TYPE_STR, false, const char*, .enum_values = NULL)
 #endif
 
 // Defines an optional integer argument of a console command (can ONLY be used for the last argument)
 // The argument will have a value of `CONSOLE_INT_ARG_DEFAULT` when not specified
 #if CONSOLE_HELP_COMMAND
-#define CONSOLE_OPTIONAL_INT_ARG_DEF(NAME, DESC) (NAME, CONSOLE_ARG_TYPE_INT, true, intptr_t, DESC)
+#define CONSOLE_OPTIONAL_INT_ARG_DEF(NAME, DESC) (NAME, CONSOLE_ARG_TYPE_INT, true, intptr_t, .enum_values = NULL, DESC)
 #else
-#define CONSOLE_OPTIONAL_INT_ARG_DEF(NAME) (NAME, CONSOLE_ARG_TYPE_INT, true, intptr_t)
+#define CONSOLE_OPTIONAL_INT_ARG_DEF(NAME) (NAME, CONSOLE_ARG_TYPE_INT, true, intptr_t, .enum_values = NULL)
 #endif
 
 // Defines an optional string argument of a console command (can ONLY be used for the last argument)
 // The argument will have a value of `CONSOLE_STR_ARG_DEFAULT` when not specified
 #if CONSOLE_HELP_COMMAND
-#define CONSOLE_OPTIONAL_STR_ARG_DEF(NAME, DESC) (NAME, CONSOLE_ARG_TYPE_STR, true, const char*, DESC)
+#define CONSOLE_OPTIONAL_STR_ARG_DEF(NAME, DESC) (NAME, CONSOLE_ARG_TYPE_STR, true, const char*, .enum_values = NULL, DESC)
+#else
+#define CONSOLE_OPTIONAL_STR_ARG_DEF(NAME) (NAME, CONSOLE_ARG_TYPE_STR, true, const char*, .enum_values = NULL)
+#endif
+
+// Defines an unsigned 32-bit integer argument of a console command
+#if CONSOLE_HELP_COMMAND
+#define CONSOLE_UINT_ARG_DEF(NAME, DESC) (NAME, CONSOLE_ARG_TYPE_UINT, false, uintptr_t, .enum_values = NULL, DESC)
+#else
+#define CONSOLE_UINT_ARG_DEF(NAME) (NAME, CONSOLE_ARG_TYPE_UINT, false, uintptr_t, .enum_values = NULL)
+#endif
+
+// Defines an optional unsigned 32-bit integer argument of a console command (can ONLY be used for the last argument)
+// The argument will have a value of `CONSOLE_UINT_ARG_DEFAULT` when not specified
+#if CONSOLE_HELP_COMMAND
+#define CONSOLE_OPTIONAL_UINT_ARG_DEF(NAME, DESC) (NAME, CONSOLE_ARG_TYPE_UINT, true, uintptr_t, .enum_values = NULL, DESC)
+#else
+#define CONSOLE_OPTIONAL_UINT_ARG_DEF(NAME) (NAME, CONSOLE_ARG_TYPE_UINT, true, uintptr_t, .enum_values = NULL)
+#endif
+
+// Defines an unsigned 32-bit integer argument of a console command which is given in hex
+#if CONSOLE_HELP_COMMAND
+#define CONSOLE_HEX_ARG_DEF(NAME, DESC) (NAME, CONSOLE_ARG_TYPE_HEX, false, uintptr_t, .enum_values = NULL, DESC)
+#else
+#define CONSOLE_HEX_ARG_DEF(NAME) (NAME, CONSOLE_ARG_TYPE_HEX, false, uintptr_t, .enum_values = NULL)
+#endif
+
+// Defines an optional unsigned 32-bit hex argument of a console command (can ONLY be used for the last argument)
+// The argument will have a value of `CONSOLE_UINT_ARG_DEFAULT` when not specified
+#if CONSOLE_HELP_COMMAND
+#define CONSOLE_OPTIONAL_HEX_ARG_DEF(NAME, DESC) (NAME, CONSOLE_ARG_TYPE_HEX, true, uintptr_t, .enum_values = NULL, DESC)
+#else
+#define CONSOLE_OPTIONAL_HEX_ARG_DEF(NAME) (NAME, CONSOLE_ARG_TYPE_HEX, true, uintptr_t, .enum_values = NULL)
+#endif
+
+// Defines a boolean argument of a console command
+#if CONSOLE_HELP_COMMAND
+#define CONSOLE_BOOL_ARG_DEF(NAME, DESC) (NAME, CONSOLE_ARG_TYPE_BOOL, false, intptr_t, .enum_values = NULL, DESC)
+#else
+#define CONSOLE_BOOL_ARG_DEF(NAME) (NAME, CONSOLE_ARG_TYPE_BOOL, false, intptr_t, .enum_values = NULL)
+#endif
+
+// Defines an optional boolean argument of a console command (can ONLY be used for the last argument)
+// The argument will have a value of `CONSOLE_INT_ARG_DEFAULT` when not specified
+#if CONSOLE_HELP_COMMAND
+#define CONSOLE_OPTIONAL_BOOL_ARG_DEF(NAME, DESC) (NAME, CONSOLE_ARG_TYPE_BOOL, true, intptr_t, .enum_values = NULL, DESC)
+#else
+#define CONSOLE_OPTIONAL_BOOL_ARG_DEF(NAME) (NAME, CONSOLE_ARG_TYPE_BOOL, true, intptr_t, .enum_values = NULL)
+#endif
+
+// Defines an enum argument of a console command - VALUES is a NULL-terminated table of names and the argument
+// is the index of the given name
+#if CONSOLE_HELP_COMMAND
+#define CONSOLE_ENUM_ARG_DEF(NAME, VALUES, DESC) (NAME, CONSOLE_ARG_TYPE_ENUM, false, intptr_t, .enum_values = VALUES, DESC)
 #else
-#define CONSOLE_OPTIONAL_STR_ARG_DEF(NAME) (NAME, CONSOLE_ARG_TYPE_STR, true, const char*)
+#define CONSOLE_ENUM_ARG_DEF(NAME, VALUES) (NAME, CONSOLE_ARG_TYPE_ENUM, false, intptr_t, .enum_values = VALUES)
 #endif
 
-// Initializes the console library
-void console_init(const console_init_t* init);
+// Defines an optional enum argument of a console command (can ONLY be used for the last argument)
+// The argument will have a value of `CONSOLE_INT_ARG_DEFAULT` when not specified
+#if CONSOLE_HELP_COMMAND
+#define CONSOLE_OPTIONAL_ENUM_ARG_DEF(NAME, VALUES, DESC) (NAME, CONSOLE_ARG_TYPE_ENUM, true, intptr_t, .enum_values = VALUES, DESC)
+#else
+#define CONSOLE_OPTIONAL_ENUM_ARG_DEF(NAME, VALUES) (NAME, CONSOLE_ARG_TYPE_ENUM, true, intptr_t, .enum_values = VALUES)
+#endif
+
+// Defines a fixed-point argument of a console command with DECIMALS decimal places (the counterpart of the
+// point_ofs of i32_to_dec()) - e.g. "1.5" is passed as 150 with 2 decimals
+#if CONSOLE_HELP_COMMAND
+#define CONSOLE_FIXED_ARG_DEF(NAME, DECIMALS, DESC) (NAME, CONSOLE_ARG_TYPE_FIXED, false, intptr_t, .decimals = DECIMALS, DESC)
+#else
+#define CONSOLE_FIXED_ARG_DEF(NAME, DECIMALS) (NAME, CONSOLE_ARG_TYPE_FIXED, false, intptr_t, .decimals = DECIMALS)
+#endif
+
+// Defines an optional fixed-point argument of a console command (can ONLY be used for the last argument)
+// The argument will have a value of `CONSOLE_FIXED_ARG_DEFAULT` when not specified
+#if CONSOLE_HELP_COMMAND
+#define CONSOLE_OPTIONAL_FIXED_ARG_DEF(NAME, DECIMALS, DESC) (NAME, CONSOLE_ARG_TYPE_FIXED, true, intptr_t, .decimals = DECIMALS, DESC)
+#else
+#define CONSOLE_OPTIONAL_FIXED_ARG_DEF(NAME, DECIMALS) (NAME, CONSOLE_ARG_TYPE_FIXED, true, intptr_t, .decimals = DECIMALS)
+#endif
+
+// Defines a streamed argument of a console command (can ONLY be used for the last argument)
+// Once the arguments before it are complete, the rest of the input line bypasses the line buffer and editing and is
+// passed to the handler in chunks as it arrives (see console_stream_t) - it's empty if the line ends right after them
+// Via binary RPC, the rest of the request is passed as a single chunk
+#if CONSOLE_STREAM_ARGS
+#if CONSOLE_HELP_COMMAND
+#define CONSOLE_STREAM_ARG_DEF(NAME, DESC) (NAME, CONSOLE_ARG_TYPE_STREAM, false, const console_stream_t*, .enum_values = NULL, DESC)
+#else
+#define CONSOLE_STREAM_ARG_DEF(NAME) (NAME, CONSOLE_ARG_TYPE_STREAM, false, const console_stream_t*, .enum_values = NULL)
+#endif
+#endif
+
+// Initializes a console instance (which should be placed according to CONSOLE_BUFFER_ATTRIBUTES)
+void console_init(console_t* console, const console_init_t* init);
 
 // Registers a console command with the console library (returns true on success)
 bool console_command_register(const console_command_def_t* cmd);
 
-// Processes received data
-void console_process(const uint8_t* data, uint32_t length);
+// Processes data received by a console instance - returns the number of bytes consumed, which is less than length
+// if a line started a resumable command (the rest should be passed again once console_busy() returns false)
+uint32_t console_process(console_t* console, const uint8_t* data, uint32_t length);
+
+// Returns the longest line the line buffer of the console held so far (at most CONSOLE_MAX_LINE_LENGTH - 1)
+uint32_t console_line_peak(const console_t* console);
+
+// Returns the console instance whose command handler is currently running (or NULL)
+console_t* console_get_current(void);
+
+// Sets the status of the currently running command (application-specific errors should be positive)
+void console_set_status(int32_t status);
+
+#if CONSOLE_MACHINE_MODE
+// Enables or disables machine mode: no echo or prompt, and the output of each command is framed as
+// STX <seq> NEWLINE <output> ETX <seq> ' ' <status> NEWLINE
+//   within <output>, the bytes 0x02 (STX), 0x03 (ETX) and 0x10 (DLE) are sent as DLE <byte ^ 0x20>
+// When enabled by the "machine" command, only the frame end is sent so the host can synchronize on it
+void console_set_machine_mode(console_t* console, bool enable);
+
+// Returns whether machine mode is enabled
+bool console_get_machine_mode(const console_t* console);
+
+// The escaping of frame output, which is done by the platform's output path (for the console's own output as well,
+// as it's written through its write_function)
+#define CONSOLE_FRAME_ESCAPE 0x10
+#define CONSOLE_FRAME_ESCAPE_XOR 0x20
+#define CONSOLE_FRAME_ESCAPED(c) ((c) == 0x02 || (c) == 0x03 || (c) == CONSOLE_FRAME_ESCAPE)
+
+// Returns true while output is written into a frame (from a command handler, or the console on its behalf) and
+// has to be escaped
+bool console_frame_active(void);
+#endif
+
+// Writes output of the currently running command through its console's output buffer (captured into the reply during binary RPC)
+void console_write_data(const char* data, uint32_t length);
+
+#if CONSOLE_BINARY_RPC
+// Binary RPC (machine mode only) - all multi-byte values are little-endian
+// request: SOH <len:u8> <seq:u8> <command hash:u16> <args...>
+//   after the SOH, the bytes 0x03 (Ctrl+C), 0x0D (CR) and 0x10 (DLE) are sent as DLE <byte ^ 0x20>, as the
+//   input path of a terminal link may act on them - len counts the bytes before escaping
+//   the hash is a 16-bit FNV-1a of the command name (see the "rpcdesc" command)
+//   args are packed in definition order (int: int32, str: NUL-terminated, stream: all remaining bytes),
+//   an optional last arg may be omitted
+// replies: SOH 'O' <len:u8> <output...> (any number of them), followed by SOH 'S' <seq:u8> <status:i32>
+// See console_rpc.py for a host-side implementation
+
+// Returns true while a command handler runs on behalf of a binary RPC request
+// Output which doesn't go through the console should then be passed to console_write_data() to get captured
+bool console_rpc_active(void);
+#endif
+
+#if CONSOLE_RESUMABLE
+// Resumable commands: instead of blocking, a handler may do a bit of work and call console_yield() before returning.
+// A command from an input line is then continued by console_poll() (e.g. from the main loop) until its handler returns
+// without yielding - meanwhile the console is busy and doesn't take input. Handlers keep their state across calls
+// themselves (e.g. in static variables) and check console_get_step() to tell the calls apart.
+// Via binary RPC or from scripts, the handler is called again right away (or after the delay of console_yield_for(),
+// through the delay_function) until it's done. Once the interrupted_function reports an interrupt, its last call is
+// with CONSOLE_STEP_CANCEL, as for console_cancel() - without an interrupted_function, such a command can't be stopped.
+
+// Requests another call of the handler of the currently running command
+void console_yield(void);
+
+// Like console_yield(), but the command has nothing to do for the next ms milliseconds (e.g. it waits for a timeout)
+void console_yield_for(uint32_t ms);
+
+// Returns how long the caller of console_poll() may wait before the next call, 0 if the command should be polled asap
+uint32_t console_resume_delay(const console_t* console);
+
+// Like console_yield(), but the command is called again (by console_process()) once input arrives, which it takes
+// with console_read_input() - a Ctrl+C still cancels it. Via binary RPC or from scripts, there's no input, so the
+// command is cancelled instead.
+void console_yield_for_input(void);
+
+// Takes up to max bytes of the input which arrived for the currently running command - returns how many
+uint32_t console_read_input(uint8_t* data, uint32_t max);
+
+// Returns true while a command of the console waits for input, which should then be passed to console_process()
+// (it's not polled meanwhile)
+bool console_waiting_for_input(const console_t* console);
+
+// Returns which call of its handler the currently running command is in
+console_step_t console_get_step(void);
+
+// Returns true while a resumable command of the console has yet to finish
+bool console_busy(const console_t* console);
+
+// Calls the handler of a yielded command again - returns true if it's still busy
+bool console_poll(console_t* console);
+
+// Calls the handler of a yielded command a last time with CONSOLE_STEP_CANCEL (e.g. on Ctrl+C)
+void console_cancel(console_t* console);
+#endif
+
+#if CONSOLE_COMMAND_STATS
+// Counts bytes which command handlers wrote to the output of their console (for the statistics of the "cmdstats"
+// command and the "time" prefix) - should be called by the lowest-level output function, e.g. _write()
+void console_count_output(uint32_t length);
+#endif
+
+#if CONSOLE_SCRIPT
+// Scripts - "script <statements>" compiles statements separated by ';' to bytecode, "run" executes it:
+//   <command> <args...>   runs a registered command (without streamed arguments), $<var> may be given
+//                         instead of a numeric literal
+//   set|add <var> <value> sets a variable (a-z, all 0 at the start) or adds to it, value is a literal or $<var>
+//   delay <ms>            pauses (needs the delay function) - with resumable commands, "run" yields for it instead
+//                         of sleeping, unless it's run via binary RPC
+//   repeat <n> / while <cond> / if <cond> [else] ... end
+//                         cond is ok or err (the status of the last command, also available as $?) or $<var>
+//                         (true if non-zero)
+//   break                 leaves the innermost repeat or while loop
+// "run" stops when the interrupted function returns true, its status is the one of the last command
+#endif
 
 #if CONSOLE_FULL_CONTROL
 // Prints a string (should end with a '\n') without visibly corrupting the current command line
-void console_print_line(const char* str);
+// In machine mode, only the string is sent (outside of a frame, unless a command is running)
+void console_print_line(console_t* console, const char* str);
 #endif
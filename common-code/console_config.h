@@ -22,6 +22,15 @@
 #define CONSOLE_NEWLINE "\n"
 #endif
 
+// Size of the buffer which collects console output before it's passed to the write function
+#ifndef CONSOLE_OUTPUT_BUFFER_SIZE
+#define CONSOLE_OUTPUT_BUFFER_SIZE 128
+#endif
+
+#if CONSOLE_OUTPUT_BUFFER_SIZE < 1
+#error "CONSOLE_OUTPUT_BUFFER_SIZE must be at least 1"
+#endif
+
 #ifndef CONSOLE_BUFFER_ATTRIBUTES
 #define CONSOLE_BUFFER_ATTRIBUTES
 #endif
@@ -30,6 +39,61 @@
 #define CONSOLE_HELP_COMMAND 1
 #endif
 
+#ifndef CONSOLE_MACHINE_MODE
+#define CONSOLE_MACHINE_MODE 1
+#endif
+
+// Binary RPC requests (only accepted in machine mode)
+#ifndef CONSOLE_BINARY_RPC
+#define CONSOLE_BINARY_RPC 1
+#endif
+
+#if CONSOLE_BINARY_RPC && !CONSOLE_MACHINE_MODE
+#error "CONSOLE_BINARY_RPC requires CONSOLE_MACHINE_MODE to be enabled"
+#endif
+
+#if CONSOLE_BINARY_RPC && CONSOLE_OUTPUT_BUFFER_SIZE > 255
+#error "CONSOLE_BINARY_RPC sends the output buffer in packets with an 8-bit length"
+#endif
+
+// Trailing streamed arguments (see CONSOLE_STREAM_ARG_DEF())
+#ifndef CONSOLE_STREAM_ARGS
+#define CONSOLE_STREAM_ARGS 1
+#endif
+
+// Command handlers which yield (see console_yield()) and are continued by console_poll()
+#ifndef CONSOLE_RESUMABLE
+#define CONSOLE_RESUMABLE 1
+#endif
+
+// Execution statistics per command (see the "cmdstats" command) and the "time" prefix
+#ifndef CONSOLE_COMMAND_STATS
+#define CONSOLE_COMMAND_STATS 1
+#endif
+
+// On-device scripts which are compiled to bytecode (see the "script" and "run" commands)
+#ifndef CONSOLE_SCRIPT
+#define CONSOLE_SCRIPT 1
+#endif
+
+// Size in bytes of the compiled script of each console
+#ifndef CONSOLE_SCRIPT_SIZE
+#define CONSOLE_SCRIPT_SIZE 256
+#endif
+
+// Maximum nesting depth of loops and conditionals in a script
+#ifndef CONSOLE_SCRIPT_MAX_DEPTH
+#define CONSOLE_SCRIPT_MAX_DEPTH 4
+#endif
+
+#if CONSOLE_SCRIPT && !CONSOLE_STREAM_ARGS
+#error "CONSOLE_SCRIPT requires CONSOLE_STREAM_ARGS to be enabled"
+#endif
+
+#if CONSOLE_SCRIPT && CONSOLE_SCRIPT_SIZE > 65535
+#error "CONSOLE_SCRIPT uses 16-bit jump targets, so CONSOLE_SCRIPT_SIZE must not exceed 65535"
+#endif
+
 #ifndef CONSOLE_FULL_CONTROL
 #define CONSOLE_FULL_CONTROL 1
 #endif
@@ -43,7 +107,16 @@
 #endif
 
 #ifndef CONSOLE_HISTORY
-#define CONSOLE_HISTORY 16
+#define CONSOLE_HISTORY 1
+#endif
+
+// Size in bytes of the history arena (each line takes its length plus 2 bytes)
+#ifndef CONSOLE_HISTORY_SIZE
+#define CONSOLE_HISTORY_SIZE 512
+#endif
+
+#if CONSOLE_HISTORY && CONSOLE_MAX_LINE_LENGTH > 256
+#error "CONSOLE_HISTORY stores 8-bit line lengths, so CONSOLE_MAX_LINE_LENGTH must not exceed 256"
 #endif
 
 #if CONSOLE_HISTORY && !CONSOLE_FULL_CONTROL
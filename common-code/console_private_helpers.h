@@ -73,7 +73,6 @@ _Static_assert(_CONSOLE_NUM_ARGS(1, 2, 3, 4, 5, 6, 7, 8, 9, 10) == 10, "_CONSOLE
         _CONSOLE_COMMAND_DEF_TAB_COMPLETE_ITER_FIELD(CMD) \
         .args = _##CMD##_ARGS_DEF, \
         .num_args = sizeof(_##CMD##_ARGS_DEF) / sizeof(console_arg_def_t), \
-        .args_ptr = _##CMD##_ARGS, \
     }; \
     static const console_command_def_t* const CMD = &_##CMD##_DEF
 #define _CONSOLE_COMMAND_DEF_WITH_TAB_COMPLETION(CMD, DESC, ...) \
@@ -90,7 +89,6 @@ _Static_assert(_CONSOLE_NUM_ARGS(1, 2, 3, 4, 5, 6, 7, 8, 9, 10) == 10, "_CONSOLE
         _CONSOLE_COMMAND_DEF_TAB_COMPLETE_ITER_FIELD(CMD) \
         .args = _##CMD##_ARGS_DEF, \
         .num_args = sizeof(_##CMD##_ARGS_DEF) / sizeof(console_arg_def_t), \
-        .args_ptr = _##CMD##_ARGS, \
     }; \
     static const console_command_def_t* const CMD = &_##CMD##_DEF
 #if CONSOLE_HELP_COMMAND
@@ -121,15 +119,14 @@ _Static_assert(_CONSOLE_NUM_ARGS(1, 2, 3, 4, 5, 6, 7, 8, 9, 10) == 10, "_CONSOLE
         _CONSOLE_MAP(_CONSOLE_ARG_DEF_HELPER, ##__VA_ARGS__) \
     }; \
     _Static_assert(sizeof(_##CMD##_ARGS_DEF) / sizeof(console_arg_def_t) == _CONSOLE_NUM_ARGS(__VA_ARGS__), "Internal error in code generation"); \
-    static void* _##CMD##_ARGS[_CONSOLE_NUM_ARGS(__VA_ARGS__)]; \
     static void CMD##_command_handler(_CONSOLE_IF_ELSE_NO_ARGS(void, const CMD##_args_t* args, ##__VA_ARGS__));
 #define _CONSOLE_ARG_DEF_HELPER(...) _CONSOLE_ARG_DEF_HELPER2 __VA_ARGS__
 #if CONSOLE_HELP_COMMAND
-#define _CONSOLE_ARG_DEF_HELPER2(NAME, ENUM_TYPE, IS_OPTIONAL, C_TYPE, DESC) \
-    { .name = #NAME, .desc = DESC, .type = ENUM_TYPE, .is_optional = IS_OPTIONAL },
+#define _CONSOLE_ARG_DEF_HELPER2(NAME, ENUM_TYPE, IS_OPTIONAL, C_TYPE, TYPE_PARAM, DESC) \
+    { .name = #NAME, .desc = DESC, .type = ENUM_TYPE, .is_optional = IS_OPTIONAL, TYPE_PARAM },
 #else
-#define _CONSOLE_ARG_DEF_HELPER2(NAME, ENUM_TYPE, IS_OPTIONAL, C_TYPE) \
-    { .name = #NAME, .type = ENUM_TYPE, .is_optional = IS_OPTIONAL },
+#define _CONSOLE_ARG_DEF_HELPER2(NAME, ENUM_TYPE, IS_OPTIONAL, C_TYPE, TYPE_PARAM) \
+    { .name = #NAME, .type = ENUM_TYPE, .is_optional = IS_OPTIONAL, TYPE_PARAM },
 #endif
 #define _CONSOLE_ARG_TYPE_HELPER(...) _CONSOLE_ARG_TYPE_HELPER2 __VA_ARGS__
 #define _CONSOLE_ARG_TYPE_HELPER2(NAME, ENUM_TYPE, IS_OPTIONAL, C_TYPE, ...) \
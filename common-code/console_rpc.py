@@ -0,0 +1,178 @@
+#!/usr/bin/env python3
+"""Host-side codec for the console's machine mode and binary RPC (see console.h)
+
+The command table is read from the device with the "rpcdesc" command, so the
+encoders always match the console_command_def_t definitions of the firmware.
+
+Example:
+    rpc = ConsoleRPC(serial.Serial('/dev/ttyACM0'))
+    rpc.connect()
+    status, output = rpc.call('echo', 42, 'hello')
+    status, output = rpc.echo(42)      # same, via the generated methods
+"""
+
+import re
+import struct
+
+SOH, STX, ETX = b'\x01', b'\x02', b'\x03'
+DLE = 0x10
+# request bytes the device's input path would act on (Ctrl+C, CR) - sent as DLE <byte ^ 0x20>
+ESCAPED = (0x03, 0x0d, DLE)
+
+STATUS_NAMES = {
+    -1: 'INVALID_LINE',
+    -2: 'COMMAND_NOT_FOUND',
+    -3: 'INVALID_ARGS',
+    -4: 'INTERRUPTED',
+}
+
+
+def command_hash(name):
+    """16-bit FNV-1a as computed by command_hash() in console.c"""
+    h = 2166136261
+    for c in name.encode():
+        h = ((h ^ c) * 16777619) & 0xffffffff
+    return (h >> 16) ^ (h & 0xffff)
+
+
+def escape(data):
+    """escapes a request after its SOH, see console.h"""
+    out = bytearray()
+    for c in data:
+        if c in ESCAPED:
+            out += bytes([DLE, c ^ 0x20])
+        else:
+            out.append(c)
+    return bytes(out)
+
+
+def unescape(data):
+    """undoes the escaping of the output in a machine mode frame (STX, ETX and DLE), see console.h"""
+    out = bytearray()
+    it = iter(data)
+    for c in it:
+        out.append(next(it, 0x20) ^ 0x20 if c == DLE else c)
+    return bytes(out)
+
+
+class ConsoleError(Exception):
+    pass
+
+
+class Command:
+    """encoder for one command, built from an rpcdesc line: <hash> <name> <arg types>"""
+
+    def __init__(self, line):
+        fields = line.split(' ')
+        self.hash = int(fields[0], 16)
+        self.name = fields[1]
+        # one letter per argument (upper case: optional), fixed-point is followed by its decimal places
+        self.types = re.findall(r'[a-zA-Z]\d?', fields[2] if len(fields) > 2 else '')
+        if command_hash(self.name) != self.hash:
+            raise ConsoleError('hash mismatch for command ' + self.name)
+
+    def encode(self, seq, args):
+        required = sum(1 for t in self.types if t.islower() and t != 'b')
+        if not required <= len(args) <= len(self.types):
+            raise ConsoleError('%s takes %d..%d arguments' % (self.name, required, len(self.types)))
+        payload = struct.pack('<BH', seq & 0xff, self.hash)
+        for t, value in zip(self.types, args):
+            t = t.lower()
+            if t in ('i', 'e'):
+                # enums are passed as the index into their table
+                payload += struct.pack('<i', value)
+            elif t in ('u', 'x'):
+                payload += struct.pack('<I', value)
+            elif t == 't':
+                payload += struct.pack('<i', bool(value))
+            elif t[0] == 'f':
+                payload += struct.pack('<i', round(value * 10 ** int(t[1:])))
+            elif t == 's':
+                payload += value.encode() + b'\x00'
+            elif t == 'b':
+                # streamed argument: the rest of the request
+                payload += value.encode() if isinstance(value, str) else bytes(value)
+            else:
+                raise ConsoleError('unsupported argument type ' + t)
+        if len(payload) > 255:
+            raise ConsoleError('request too long')
+        return SOH + escape(bytes([len(payload)]) + payload)
+
+
+class ConsoleRPC:
+    """port needs read(n) and write(data) - e.g. a pyserial Serial object"""
+
+    def __init__(self, port):
+        self.port = port
+        self.seq = 0
+        self.commands = {}
+
+    def _read_until(self, marker):
+        data = b''
+        while not data.endswith(marker):
+            c = self.port.read(1)
+            if not c:
+                raise ConsoleError('timeout')
+            data += c
+        return data
+
+    def _read_exact(self, n):
+        data = b''
+        while len(data) < n:
+            chunk = self.port.read(n - len(data))
+            if not chunk:
+                raise ConsoleError('timeout')
+            data += chunk
+        return data
+
+    def text_command(self, line):
+        """runs a text command in machine mode and returns (status, output)"""
+        self.port.write(line.encode() + b'\n')
+        self._read_until(STX)
+        self._read_until(b'\n')
+        output = self._read_until(ETX)[:-1]
+        trailer = self._read_until(b'\n').decode().strip().split(' ')
+        return int(trailer[1]), unescape(output).decode().replace('\r\n', '\n')
+
+    def connect(self):
+        """switches the console to machine mode and loads the command table"""
+        self.port.write(b'\x03machine 1\n')
+        # the frame end of the "machine 1" command is the sync point
+        self._read_until(ETX)
+        self._read_until(b'\n')
+        status, output = self.text_command('rpcdesc')
+        if status:
+            raise ConsoleError('rpcdesc failed: %d' % status)
+        self.commands = {}
+        for line in output.splitlines():
+            if line:
+                cmd = Command(line)
+                self.commands[cmd.name] = cmd
+                if not hasattr(self, cmd.name):
+                    setattr(self, cmd.name, lambda *args, _name=cmd.name: self.call(_name, *args))
+
+    def call(self, name, *args):
+        """invokes a command via binary RPC and returns (status, output bytes)"""
+        seq = self.seq
+        self.seq = (self.seq + 1) & 0xff
+        self.port.write(self.commands[name].encode(seq, args))
+        output = b''
+        while True:
+            self._read_until(SOH)
+            kind = self._read_exact(1)
+            if kind == b'O':
+                output += self._read_exact(self._read_exact(1)[0])
+            elif kind == b'S':
+                reply_seq, status = struct.unpack('<Bi', self._read_exact(5))
+                if reply_seq != seq:
+                    raise ConsoleError('sequence mismatch (%d != %d)' % (reply_seq, seq))
+                return status, output
+
+
+if __name__ == '__main__':
+    import sys
+    import serial
+    rpc = ConsoleRPC(serial.Serial(sys.argv[1] if len(sys.argv) > 1 else '/dev/ttyACM0', timeout=2))
+    rpc.connect()
+    for cmd in rpc.commands.values():
+        print('%04x %-12s %s' % (cmd.hash, cmd.name, ''.join(cmd.types)))
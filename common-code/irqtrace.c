@@ -0,0 +1,88 @@
+#include "platform.h"
+#include "irqtrace.h"
+
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/timer.h>
+#include <libopencm3/cm3/cortex.h>
+
+#include <string.h>
+
+#ifdef IRQ_TRACE
+
+static irq_trace_stats_t irq_stats[IRQ_TRACE_IRQS];
+static irq_mask_stats_t mask_stats[IRQ_MASK_SITES];
+static uint16_t irq_off_since;
+
+uint16_t RAMFUNC_HOT irq_trace_now(void) {
+	return TIM_CNT(TIM3);
+}
+
+/* log2 buckets starting at 1us - compares only, the M0 has no divider */
+static uint32_t RAMFUNC_HOT bucket(uint16_t ticks) {
+	uint32_t i, edge = IRQ_TRACE_US(1);
+	for(i=0; (i < (IRQ_TRACE_BUCKETS - 1)) && (ticks >= edge); i++, edge <<= 1)
+		;
+	return i;
+}
+
+void RAMFUNC_HOT irq_trace_isr(enum irq_trace_irq irq, uint16_t entry, uint16_t latency) {
+	irq_trace_stats_t *s = &irq_stats[irq];
+	uint16_t duration = irq_trace_now() - entry;
+
+	s->count++;
+	s->duration[bucket(duration)]++;
+	s->duration_max = MAX(s->duration_max, duration);
+	if(latency != IRQ_TRACE_NO_LATENCY) {
+		s->latency_count++;
+		s->latency[bucket(latency)]++;
+		s->latency_max = MAX(s->latency_max, latency);
+	}
+}
+
+/* the stretches are only written from thread mode, with the IRQs they could race with masked */
+void irq_trace_masked(enum irq_trace_mask site, uint16_t since) {
+	irq_mask_stats_t *m = &mask_stats[site];
+	uint16_t len = irq_trace_now() - since;
+	m->count++;
+	m->max = MAX(m->max, len);
+}
+
+void irq_trace_off_begin(void) {
+	irq_off_since = irq_trace_now();
+}
+
+void irq_trace_off_end(void) {
+	irq_trace_masked(IRQ_MASK_IDLE, irq_off_since);
+}
+
+void irq_trace_get(irq_trace_stats_t *irqs, irq_mask_stats_t *masks) {
+	uint32_t mask = cm_mask_interrupts(1);
+	memcpy(irqs, irq_stats, sizeof(irq_stats));
+	memcpy(masks, mask_stats, sizeof(mask_stats));
+	cm_mask_interrupts(mask);
+}
+
+void irq_trace_clear(void) {
+	uint32_t mask = cm_mask_interrupts(1);
+	memset(irq_stats, 0, sizeof(irq_stats));
+	memset(mask_stats, 0, sizeof(mask_stats));
+	cm_mask_interrupts(mask);
+}
+
+/* the counter clock stays at IRQ_TRACE_HZ when the clock governor changes the APB clock. the new prescaler
+ * applies from the next wrap - an update event would reset the counter under the running measurements */
+static void irq_trace_set_prescaler(void) {
+	timer_set_prescaler(TIM3, (rcc_apb1_frequency / IRQ_TRACE_HZ) - 1);
+}
+
+static clock_notifier_t irq_trace_clock_notifier = { .changed = irq_trace_set_prescaler };
+
+void irq_trace_init(void) {
+	rcc_periph_clock_enable(RCC_TIM3);
+	rcc_periph_reset_pulse(RST_TIM3);
+	timer_set_period(TIM3, 0xffff);
+	irq_trace_set_prescaler();
+	clock_notifier_add(&irq_trace_clock_notifier);
+	timer_enable_counter(TIM3);
+}
+#endif /* IRQ_TRACE */
@@ -0,0 +1,57 @@
+#ifndef IRQTRACE_H
+#define IRQTRACE_H
+
+#include <stdint.h>
+
+/* interrupt latency & duration tracing
+ *
+ * TIM3 runs freely at IRQ_TRACE_HZ, regardless of the clock governor. the ISRs timestamp their entry and exit, the
+ * duration is the difference. the latency is how late an ISR was entered after its IRQ was raised: SysTick tells by
+ * its own counter, usb_isr by the SOF interrupt which is due 1ms after the previous one (SOF IRQs are enabled for
+ * this, 1000/s). the stretches with masked interrupts are tracked as well: the idle paths of sched_run() and
+ * wait_event() with the catch-up of idle_sleep() and clock_set_speed() (PRIMASK), ACM_tx and ACM_rx_free (USB IRQ).
+ * all times are in TIM3 ticks and wrap after 65536 of them (5.46ms) */
+
+#define IRQ_TRACE_HZ			12000000	/* the APB clock at idle speed */
+#define IRQ_TRACE_US(us)		((us) * (IRQ_TRACE_HZ / 1000000))
+#define IRQ_TRACE_BUCKETS		8			/* histogram buckets: <1us, <2us, <4us ... <64us, >=64us */
+#define IRQ_TRACE_NO_LATENCY	UINT16_MAX
+
+enum irq_trace_irq  { IRQ_TRACE_USB, IRQ_TRACE_SYSTICK, IRQ_TRACE_IRQS };
+enum irq_trace_mask { IRQ_MASK_IDLE, IRQ_MASK_CLOCK, IRQ_MASK_ACM_TX, IRQ_MASK_ACM_RX_FREE, IRQ_MASK_SITES };
+
+typedef struct {
+	uint32_t count;
+	uint32_t latency_count;		/* entries with a known latency */
+	uint32_t latency[IRQ_TRACE_BUCKETS];
+	uint32_t duration[IRQ_TRACE_BUCKETS];
+	uint16_t latency_max;
+	uint16_t duration_max;
+} irq_trace_stats_t;
+
+typedef struct {
+	uint32_t count;
+	uint16_t max;
+} irq_mask_stats_t;
+
+#ifdef IRQ_TRACE
+void     irq_trace_init(void);
+uint16_t irq_trace_now(void);
+/* called at the end of an ISR with its entry timestamp, IRQ_TRACE_NO_LATENCY if the latency isn't known */
+void     irq_trace_isr(enum irq_trace_irq irq, uint16_t entry, uint16_t latency);
+/* a stretch of masked interrupts, which began at 'since', ends */
+void     irq_trace_masked(enum irq_trace_mask site, uint16_t since);
+/* a PRIMASK stretch of the idle paths - IRQs must stay disabled in between. the WFI is left out, as an IRQ
+ * which becomes pending wakes the core right away */
+void     irq_trace_off_begin(void);
+void     irq_trace_off_end(void);
+
+/* copies the statistics, irqs has IRQ_TRACE_IRQS and masks IRQ_MASK_SITES entries */
+void     irq_trace_get(irq_trace_stats_t *irqs, irq_mask_stats_t *masks);
+void     irq_trace_clear(void);
+#else
+#define irq_trace_off_begin()	((void)0)
+#define irq_trace_off_end()		((void)0)
+#endif
+
+#endif /* IRQTRACE_H */
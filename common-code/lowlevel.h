@@ -3,7 +3,7 @@
 
 #include <stdint.h>
 
-/* delay_loop: 20.83ns * 4 * n */
+/* delay_loop: ~4 cycles * n on a Cortex-M0 - use the calibrated delay functions of platform.h */
 void __attribute__((long_call)) delay_loop(uint32_t n);
 
 #endif // LOWLEVEL_H
@@ -1,4 +1,5 @@
 #include "platform.h"
+#include "sched.h"
 
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/gpio.h>
@@ -7,6 +8,8 @@
 #include <libopencm3/cm3/scb.h>
 #include <libopencm3/cm3/nvic.h>
 #include <libopencm3/cm3/systick.h>
+#include <libopencm3/cm3/cortex.h>
+#include <libopencm3/cm3/vector.h>
 
 #include <stdint.h>
 #include <inttypes.h>
@@ -18,28 +21,263 @@ static void gpio_setup(void) {
 
 volatile uint32_t jiffies = 0;
 
-void sys_tick_handler(void) {
-	jiffies++;
+#ifdef TICKLESS_IDLE
+/* SysTick runs from HCLK/8, so a single one-shot period can span 2^24/6MHz = 2.8s */
+#define SYSTICK_DIV 8
+#else
+#define SYSTICK_DIV 1
+#endif
+
+static uint32_t tick_period;	/* SysTick counts per jiffy */
+static uint32_t us_per_count_q16;	/* 16 bit fraction */
+static uint32_t clock_div = 1;		/* AHB prescaler set by the clock governor */
+static volatile uint32_t jiffies_hi;	/* upper 32 bit of the 64 bit jiffies, for uptime_us() */
+#ifdef IRQ_TRACE
+static uint32_t systick_restarted;	/* the pending tick's reload was overwritten by systick_restart() */
+#endif
+
+static void RAMFUNC_HOT jiffies_add(uint32_t ticks) {
+	uint32_t j = jiffies + ticks;
+	if(j < jiffies)
+		jiffies_hi++;
+	jiffies = j;
+}
+
+#ifdef IRQ_TRACE
+/* the latency is the time since the reload which raised the IRQ, converted from SysTick counts to trace ticks */
+void RAMFUNC_HOT sys_tick_handler(void) {
+	uint16_t entry = irq_trace_now();
+	uint32_t latency = IRQ_TRACE_NO_LATENCY;
+	if(!systick_restarted) {
+		latency = (STK_RVR - STK_CVR) * SYSTICK_DIV * clock_div / (CORE_CLOCK_HZ / IRQ_TRACE_HZ);
+		latency = MIN(latency, IRQ_TRACE_NO_LATENCY - 1);
+	}
+	systick_restarted = 0;
+	jiffies_add(1);
+	irq_trace_isr(IRQ_TRACE_SYSTICK, entry, latency);
+}
+#else
+void RAMFUNC_HOT sys_tick_handler(void) {
+	jiffies_add(1);
+}
+#endif
+
+/* full speed core clock cycles since boot (wraps after ~89s): whole SysTick periods + the current one
+ * must not be called with IRQs disabled, as a pending SysTick IRQ would be missed */
+uint32_t cycles(void) {
+	uint32_t j, val;
+	do {
+		j = jiffies;
+		val = systick_get_value();
+	} while(j != jiffies);
+	return (j * (CORE_CLOCK_HZ / HZ)) + ((tick_period - 1 - val) * SYSTICK_DIV * clock_div);
+}
+
+uint64_t uptime_us(void) {
+	uint32_t hi, j, val, pending;
+	uint64_t ticks;
+	do {
+		hi = jiffies_hi;
+		j = jiffies;
+		val = systick_get_value();
+		/* with IRQs disabled (or in a higher priority ISR) the tick may have ended without jiffies counting it */
+		pending = !!(SCB_ICSR & SCB_ICSR_PENDSTSET);
+		if(pending)
+			val = systick_get_value();	/* read again, to be sure it's after the wrap */
+	} while((j != jiffies) || (hi != jiffies_hi));
+	ticks = (((uint64_t)hi << 32) | j) + pending;
+	return (ticks * USEC_PER_TICK) + (((tick_period - 1 - val) * us_per_count_q16) >> 16);
+}
+
+uint32_t deadline_ticks(deadline_t d) {
+	uint64_t now = uptime_us();
+	if(now >= d)
+		return 0;
+	if((d - now) > (UINT32_MAX - USEC_PER_TICK))
+		return UINT32_MAX / USEC_PER_TICK;
+	return ((uint32_t)(d - now) + USEC_PER_TICK - 1) / USEC_PER_TICK;
+}
+
+/* restarts SysTick with 'left' counts until the next jiffy, then continues with regular ticks */
+static void systick_restart(uint32_t left) {
+	STK_RVR = MAX(left, 2) - 1;	/* a reload value of 0 would stop the timer */
+	STK_CVR = 0;
+	systick_counter_enable();
+	while(!STK_CVR) {}			/* wait for the reload before setting the regular period */
+	STK_RVR = tick_period - 1;
+#ifdef IRQ_TRACE
+	systick_restarted = !!(SCB_ICSR & SCB_ICSR_PENDSTSET);
+#endif
 }
 
-void timeout_set(timeout_t *to, uint32_t ticks) {
-	to->start = jiffies;
-	to->expired = ticks == 0;
-	to->end = to->start + ticks + 1;          /* need to add 2 timer cycles b/c current cycle already started */
-	to->need_rollover = to->start >= to->end; /* ticks is at least 1 so equal case means a rollover too */
-	to->rollover = 0;
+/* SysTick period and the derived conversion factors for the current rcc_ahb_frequency */
+static void systick_timebase(void) {
+	tick_period = rcc_ahb_frequency / SYSTICK_DIV / HZ;
+	us_per_count_q16 = (USEC_PER_TICK << 16) / tick_period;
 }
 
-int timeout_check(timeout_t *to, uint32_t now) {
-	to->rollover |= now < to->start;
-	to->expired  |= ((now >= to->end) && (to->rollover >= to->need_rollover)) || (to->rollover > to->need_rollover);
-	return to->expired;
+/* WFI with IRQs disabled, which wakes up when one becomes pending - so the sleep doesn't delay it and is left out
+ * of the traced stretch of masked IRQs */
+static inline void idle_wfi(void) {
+	irq_trace_off_end();
+	__WFI();
+	irq_trace_off_begin();
+}
+
+#ifdef TICKLESS_IDLE
+
+void idle_sleep(uint32_t ticks) {
+	uint32_t remaining, total, elapsed, left;
+
+	ticks = MIN(ticks, (STK_RVR_RELOAD + 1) / tick_period);
+	if((ticks < 2) || (SCB_ICSR & SCB_ICSR_PENDSTSET)) {
+		idle_wfi();
+		return;
+	}
+
+	/* stretch the current tick to end 'ticks' jiffies from now, the intermediate SysTick IRQs are skipped */
+	systick_counter_disable();
+	if(SCB_ICSR & SCB_ICSR_PENDSTSET) {		/* the tick ended just now */
+		systick_counter_enable();
+		idle_wfi();
+		return;
+	}
+	remaining = STK_CVR + 1;
+	total = remaining + (ticks - 1) * tick_period;
+	STK_RVR = total - 1;
+	STK_CVR = 0;
+	systick_counter_enable();
+
+	idle_wfi();
+
+	/* catch up jiffies for the time slept */
+	systick_counter_disable();
+	if(SCB_ICSR & SCB_ICSR_PENDSTSET) {
+		/* slept all the way - the pending SysTick IRQ counts the last jiffy */
+		jiffies_add(ticks - 1);
+		elapsed = total - 1 - STK_CVR;		/* since the wrap, the counter reloaded 'total' */
+		left = (elapsed < tick_period) ? (tick_period - elapsed) : 0;
+	} else {
+		/* woken early by another IRQ */
+		elapsed = total - 1 - STK_CVR;
+		if(elapsed < remaining) {
+			left = remaining - elapsed;
+		} else {
+			elapsed -= remaining;
+			jiffies_add(1 + (elapsed / tick_period));
+			left = tick_period - (elapsed % tick_period);
+		}
+	}
+	systick_restart(left);
+}
+#else
+void idle_sleep(uint32_t ticks) {
+	(void)ticks;
+	idle_wfi();
+}
+#endif /* TICKLESS_IDLE */
+
+/* SysTick counts since a snapshot of the counter, which wraps once per jiffy */
+static uint32_t RAMFUNC_HOT systick_counts_since(uint32_t start) {
+	uint32_t now = systick_get_value();
+	return (start >= now) ? (start - now) : (start + tick_period - now);
+}
+
+uint32_t RAMFUNC_HOT stopwatch_start(void) {
+	return systick_get_value();
+}
+
+uint32_t RAMFUNC_HOT stopwatch_cycles(uint32_t start) {
+	return systick_counts_since(start) * SYSTICK_DIV * clock_div;
+}
+
+/* delay_loop iterations per 64k core clock cycles, measured by delay_calibrate() */
+static uint32_t loops_per_64k_cycles;
+static uint32_t loops_per_us_q16, loops_per_ms;
+/* SysTick counts per ns, 16 bit fraction */
+static uint32_t counts_per_ns_q16;
+
+/* the loop timing in cycles doesn't depend on the clock, only the conversions to time */
+static void delay_rescale(void) {
+	loops_per_us_q16 = loops_per_64k_cycles * (rcc_ahb_frequency / 1000000);
+	loops_per_ms = (loops_per_us_q16 * 1000) >> 16;
+	counts_per_ns_q16 = ((uint64_t)tick_period << 16) / (USEC_PER_TICK * 1000);
+}
+
+/* SysTick counts spent in delay_loop(loops) - must be less than a jiffy */
+static uint32_t delay_loop_counts(uint32_t loops) {
+	uint32_t start = systick_get_value();
+	delay_loop(loops);
+	return systick_counts_since(start);
+}
+
+void delay_calibrate(void) {
+	uint32_t mask = cm_mask_interrupts(1), counts;
+	/* the difference of 2 runs cancels the call overhead */
+	counts = delay_loop_counts(8192) - delay_loop_counts(4096);
+	cm_mask_interrupts(mask);
+
+	loops_per_64k_cycles = (4096UL << 16) / (counts * SYSTICK_DIV);
+	delay_rescale();
+}
+
+void delay_cycles(uint32_t n) {
+	if(n < 0x10000)
+		delay_loop((n * loops_per_64k_cycles) >> 16);
+	else
+		delay_loop(((uint64_t)n * loops_per_64k_cycles) >> 16);
+}
+
+void delay_us(uint32_t us) {
+	for(; us > 1000; us -= 1000)
+		delay_loop(loops_per_ms);
+	delay_loop((us * loops_per_us_q16) >> 16);
+}
+
+void delay_ms(uint32_t ms) {
+	for(; ms; ms--)
+		delay_loop(loops_per_ms);
+}
+
+void delay_ns(uint32_t ns) {
+	uint32_t wait, elapsed = 0, last, now;
+	if(ns > 1000000) {		/* keep the multiplication below in 32 bit */
+		delay_us(ns / 1000);
+		ns %= 1000;
+	}
+	wait = ((ns * counts_per_ns_q16) + 0xffff) >> 16;
+	for(last = systick_get_value(); elapsed < wait; last = now) {
+		now = systick_get_value();
+		elapsed += systick_counts_since(last);
+	}
+}
+
+static volatile uint32_t event_flags;
+
+void RAMFUNC_HOT event_post(uint32_t events) {
+	uint32_t mask = cm_mask_interrupts(1);	/* no atomic OR on Cortex-M0 */
+	event_flags |= events;
+	sched_events |= events;		/* also makes the tasks waiting for them due */
+	cm_mask_interrupts(mask);
+}
+
+uint32_t wait_event(uint32_t mask, deadline_t deadline) {
+	uint32_t fired;
+	/* same as SLEEP_UNTIL_IRQDISABLE: an event posted after the check makes WFI return immediately */
+	for(__disable_irq(), irq_trace_off_begin(); !(fired = (event_flags & mask)) && !deadline_passed(deadline);
+			__disable_irq(), irq_trace_off_begin()) {
+		idle_sleep(deadline_ticks(deadline));
+		irq_trace_off_end();
+		__enable_irq();		/* run ISR */
+	}
+	event_flags &= ~fired;
+	irq_trace_off_end();
+	__enable_irq();
+	return fired;
 }
 
 void timeout_sleep(timeout_t *to) {
-	uint32_t last;
-	for(last=jiffies; !timeout_check(to, last); last=jiffies)
-		SLEEP_UNTIL(last != jiffies);
+	wait_event(0, to->end);
 }
 
 /*
@@ -57,14 +295,21 @@ static void clocks_setup(void) {
 }
 
 static void systick_setup(void) {
-	systick_set_frequency(HZ, rcc_ahb_frequency);
+#ifdef TICKLESS_IDLE
+	systick_set_clocksource(STK_CSR_CLKSOURCE_AHB_DIV8);
+#else
+	systick_set_clocksource(STK_CSR_CLKSOURCE_AHB);
+#endif
+	systick_timebase();
+	systick_set_reload(tick_period - 1);
 	systick_clear();
 	systick_counter_enable();
 	nvic_set_priority(NVIC_SYSTICK_IRQ, 255);  // lowest priority
 	systick_interrupt_enable();
+	delay_calibrate();
 }
 
-static void __attribute__( (section(".data#"), long_call, noinline) ) erase0_ram_func(void) {   /* extra # after section name mutes the asm warning m) */
+static void RAMFUNC erase0_ram_func(void) {
 #if defined(STM32F0)
 	FLASH_CR |= FLASH_CR_PER;
 	FLASH_AR = 0x08000000; /* erase the page of the vetor table to enforce bootloader mode */
@@ -101,8 +346,140 @@ void erase_page0(uint32_t safety_key) {
 	erase0_ram_func();
 }
 
+/* clock governor: only the AHB prescaler changes, SYSCLK stays on the 48MHz HSI (USB needs it on the F0)
+ * and APB1 follows AHB - 12MHz idle keeps it above the 10MHz minimum of the USB peripheral */
+#define CLOCK_IDLE_DIV	4
+
+static clock_notifier_t *clock_notifiers;
+
+void clock_notifier_add(clock_notifier_t *notifier) {
+	notifier->next = clock_notifiers;
+	clock_notifiers = notifier;
+}
+
+int clock_full_speed(void) {
+	return clock_div == 1;
+}
+
+void clock_set_speed(int full) {
+	uint32_t div = full ? 1 : CLOCK_IDLE_DIV, mask, left;
+	clock_notifier_t *n;
+#ifdef IRQ_TRACE
+	uint16_t masked;
+#endif
+	if(div == clock_div)
+		return;
+
+	mask = cm_mask_interrupts(1);
+#ifdef IRQ_TRACE
+	masked = irq_trace_now();
+#endif
+	/* SysTick counts at the new clock for the rest of the current jiffy */
+	systick_counter_disable();
+	left = ((STK_CVR + 1) * clock_div) / div;
+	rcc_set_hpre(full ? RCC_CFGR_HPRE_NODIV : RCC_CFGR_HPRE_DIV4);
+	clock_div = div;
+	rcc_ahb_frequency = CORE_CLOCK_HZ / div;
+	rcc_apb1_frequency = rcc_ahb_frequency;
+	systick_timebase();
+	systick_restart(left);
+	delay_rescale();
+#ifdef IRQ_TRACE
+	irq_trace_masked(IRQ_MASK_CLOCK, masked);	/* includes the busy-wait of systick_restart() */
+#endif
+	cm_mask_interrupts(mask);
+
+	for(n=clock_notifiers; n; n=n->next)
+		n->changed();
+}
+
+#if defined(RAM_VECTORS) && defined(STM32C0)
+/* VTOR needs the table aligned to its size rounded up to a power of 2: 48 vectors -> 256 bytes */
+static vector_table_t ram_vector_table __attribute__((aligned(256)));
+
+/* exception entry fetches the vector from SRAM instead of flash (Cortex-M0+ only, the M0 of the F0 has no VTOR) */
+static void vectors_to_ram(void) {
+	ram_vector_table = vector_table;
+	__DSB();
+	SCB_VTOR = (uint32_t)&ram_vector_table;
+	__DSB();
+}
+#else
+static void vectors_to_ram(void) {}
+#endif
+
+#ifdef STACK_WATERMARK
+#ifndef ISR_STACK_SIZE
+#define ISR_STACK_SIZE	512
+#endif
+#define STACK_PAINT		0xC5C5C5C5
+
+/* from the libopencm3 linker script: end of .bss (= start of the heap) and the initial SP at the end of RAM */
+extern uint32_t heap_start __asm__("end");
+extern uint32_t stack_top __asm__("_stack");
+
+static uint32_t isr_stack[ISR_STACK_SIZE / 4] __attribute__((aligned(8)));
+
+/* the heap grows up into the painted area of the main stack */
+#ifndef NO_STDIO
+void *_sbrk(ptrdiff_t incr);	/* libnosys */
+#endif
+
+static uint32_t *heap_end(void) {
+#ifndef NO_STDIO
+	return (uint32_t *)(((uint32_t)_sbrk(0) + 3) & ~3);
+#else
+	return &heap_start;
+#endif
+}
+
+/* thread mode continues on the current stack as PSP, exceptions get their own stack on MSP
+ * so both high-water marks can be told apart. must run before any IRQ is enabled */
+static void stacks_setup(void) {
+	uint32_t *p, *sp;
+
+	for(p=isr_stack; p<isr_stack + (ISR_STACK_SIZE / 4); p++)
+		*p = STACK_PAINT;
+
+	__asm__ volatile(
+		"mrs %0, msp\n"
+		"msr psp, %0\n"
+		"movs %0, #2\n"		/* CONTROL.SPSEL */
+		"msr control, %0\n"
+		"isb\n"
+		"msr msp, %1\n"
+		: "=&l"(sp) : "r"(isr_stack + (ISR_STACK_SIZE / 4)) : "memory");
+
+	/* paint from the heap up to a bit below our own frame */
+	__asm__ volatile("mov %0, sp" : "=r"(sp));
+	for(p=heap_end(); p<sp - 8; p++)
+		*p = STACK_PAINT;
+}
+
+static uint32_t unpainted(const uint32_t *p, const uint32_t *top) {
+	for(; (p < top) && (*p == STACK_PAINT); p++)
+		;
+	return (uint32_t)top - (uint32_t)p;
+}
+
+void stack_usage(mem_usage_t *main, mem_usage_t *isr) {
+	uint32_t *bottom = heap_end();
+	main->peak = unpainted(bottom, &stack_top);
+	main->size = (uint32_t)&stack_top - (uint32_t)bottom;
+	isr->peak = unpainted(isr_stack, isr_stack + (ISR_STACK_SIZE / 4));
+	isr->size = sizeof(isr_stack);
+}
+#else
+static void stacks_setup(void) {}
+#endif
+
 void hw_init(void) {
+	stacks_setup();
+	vectors_to_ram();
 	clocks_setup();
+#ifdef IRQ_TRACE
+	irq_trace_init();
+#endif
 	systick_setup();
 	gpio_setup();
 	usb_setup();
@@ -8,37 +8,88 @@
 #include <libopencmsis/core_cm3.h>
 #include "utils.h"
 #include "lowlevel.h"
+#include "irqtrace.h"
 
-/* simple core delay loop w/o sleeping */
-#define delay_cycles(n)   delay_loop((n)>>2)   // no need for +1 because there's always 5 extra cycles anyway
-#define delay_us(n)       delay_loop((n)*12)
-#define delay_ms(n)       delay_loop((n)*12000)
+/* interval measurement from any context (ISRs, IRQs disabled) based on the SysTick counter
+ * stopwatch_cycles() returns the full speed core clock cycles since stopwatch_start(), for intervals shorter than a jiffy */
+uint32_t stopwatch_start(void);
+uint32_t stopwatch_cycles(uint32_t start);
+
+/* busy-wait delays w/o sleeping (fine with IRQs disabled) - delay_loop calibrated against SysTick
+ * by hw_init(), call delay_calibrate() again after changing the core clock */
+void delay_calibrate(void);
+void delay_cycles(uint32_t n);
+void delay_us(uint32_t us);
+void delay_ms(uint32_t ms);
+/* polls the SysTick counter instead: accurate to one SysTick count (1 core clock, 8 with TICKLESS_IDLE)
+ * plus ~20 cycles call overhead, for short delays in bit-banged protocols */
+void delay_ns(uint32_t ns);
+
+/* functions run from SRAM, without flash wait states: libopencm3's linker script collects .ramtext into .data,
+ * which reset_handler copies from flash at startup. long_call as SRAM is out of BL range of the flash code */
+#define RAMFUNC           __attribute__((section(".ramtext"), long_call, noinline))
+/* ISR hot paths: in SRAM with RAM_HOT_PATHS (see config.h), so the latency can be compared both ways */
+#ifdef RAM_HOT_PATHS
+#define RAMFUNC_HOT       RAMFUNC
+#else
+#define RAMFUNC_HOT
+#endif
 
 #define HZ                100
 #define MSEC             (1000/HZ)
 #define SEC              (1000*MSEC)
 #define MS_TO_TICKS(a)   (((a)+(MSEC-1))/MSEC)
 
+#define USEC_PER_TICK    (1000000/HZ)
+
 extern volatile uint32_t jiffies;
 
+/* full speed core clock (clocks_setup()), the clock governor may run the core slower */
+#define CORE_CLOCK_HZ     48000000
+
+/* cycle counter based on SysTick - counts time in full speed core clock cycles, whatever the current clock */
+uint32_t cycles(void);
+
+/* monotonic microseconds since boot: jiffies extended to 64 bit + the SysTick count within the current jiffy
+ * safe to call from ISRs and with IRQs disabled */
+uint64_t uptime_us(void);
+
+/* absolute time in microseconds since boot - 64 bit don't wrap, so checking a deadline is one comparison */
+typedef uint64_t deadline_t;
+#define deadline_in_us(us)  (uptime_us() + (us))
+#define deadline_in_ms(ms)  (uptime_us() + (uint64_t)(ms) * 1000)
+#define deadline_passed(d)  (uptime_us() >= (d))
+/* jiffies until the deadline (rounded up, 0 if it passed), e.g. for idle_sleep() */
+uint32_t deadline_ticks(deadline_t d);
+
 typedef struct timeout_s {
-	uint32_t start;
-	uint32_t end;
-	int need_rollover;
-	int expired;
-	int rollover;
+	deadline_t end;
 } timeout_t;
 
 /* systick based timeouts / sleep functions */
-void    timeout_set(timeout_t *to, uint32_t ticks);
-int     timeout_check(timeout_t *to, uint32_t now);
-#define timeout(to) timeout_check(to, jiffies)
+#define timeout_set(to, ticks) do { (to)->end = deadline_in_us((uint64_t)(ticks) * USEC_PER_TICK); } while(0)
+#define timeout(to) deadline_passed((to)->end)
 void    timeout_sleep(timeout_t *to);
+
+/* sleeps (WFI) until an IRQ is pending, but at most for 'ticks' jiffies - call with IRQs disabled
+ * with TICKLESS_IDLE the SysTick IRQs in between are skipped and jiffies is caught up on wakeup */
+void    idle_sleep(uint32_t ticks);
 //void    sleep_ms(uint32_t ms);
 #define sleep_ms(ms) do { timeout_t to; timeout_set(&to, MS_TO_TICKS(ms)); timeout_sleep(&to); } while(0)
 
 void hw_init(void);
 
+/* clock governor: full speed or the idle clock (12MHz) - rescales rcc_ahb/apb1_frequency, SysTick and the delays
+ * notifiers are called after each change, e.g. to rescale timer prescalers */
+typedef struct clock_notifier_s {
+	void (*changed)(void);
+	struct clock_notifier_s *next;
+} clock_notifier_t;
+
+void clock_notifier_add(clock_notifier_t *notifier);
+void clock_set_speed(int full);
+int  clock_full_speed(void);
+
 /* checks condition with IRQs disabled
  * WARNING: leaves IRQs disabled - you must enable them manually again */
 #define SLEEP_UNTIL_IRQDISABLE(cond) for(__disable_irq(); !(cond); ) {								\
@@ -50,16 +101,52 @@ void hw_init(void);
 
 #define SLEEP_UNTIL(cond) do { SLEEP_UNTIL_IRQDISABLE(cond); __enable_irq(); } while(0)
 
+/* event flags set by ISRs - latched until a wait_event() returns them, so none gets lost between
+ * checking a condition and going to sleep. they also wake the scheduler's tasks with matching events (sched.h).
+ * the flags are only wakeups: re-check the actual state after waking */
+#define EVENT_RX          (1 << 0)	/* USB ACM data received */
+#define EVENT_TX          (1 << 1)	/* USB ACM tx buffer space freed / transmission done */
+#define EVENT_SIGINT      (1 << 2)	/* Ctrl+C received */
+#define EVENT_USER(n)     (1 << (8 + (n)))
+
+#define DEADLINE_NEVER    UINT64_MAX
+
+/* safe to call from ISRs */
+void     event_post(uint32_t events);
+/* sleeps until one of the events in mask is posted or the deadline passed
+ * returns (and clears) the events which fired, 0 on timeout. mask 0 just sleeps until the deadline */
+uint32_t wait_event(uint32_t mask, deadline_t deadline);
+
 extern volatile uint32_t ACM_rx_fill;
 
 extern volatile uint32_t SIGINT;
 
+/* ascii: \n is sent as \r\n - with ACM_TX_ESCAPE, also escapes the output of a machine mode frame (see console.h) */
+#define ACM_TX_ESCAPE	2
 int  ACM_tx(const void *p, size_t n, int ascii);
+int  ACM_stdout(const void *p, size_t n);
 void ACM_waitfor_txdone(void);
-void ACM_to_console(void);
+struct console;
+uint32_t ACM_to_console(struct console *console);
 int  ACM_readbyte(void);
 void usb_shutdown(void);
+/* longest usb_isr() run in core clock cycles */
+uint32_t usb_isr_max_cycles(int reset);
 
 void erase_page0(uint32_t safety_key);
 
+/* peak usage of a stack or buffer in bytes since boot */
+typedef struct {
+	uint32_t peak;
+	uint32_t size;
+} mem_usage_t;
+
+void ACM_buf_usage(mem_usage_t *rx, mem_usage_t *tx);
+
+#ifdef STACK_WATERMARK
+/* high-water marks of the painted stacks: main is the thread mode stack (PSP) down to the heap,
+ * isr the separate ISR_STACK_SIZE exception stack (MSP) */
+void stack_usage(mem_usage_t *main, mem_usage_t *isr);
+#endif
+
 #endif /* PLATFORM_H */
@@ -0,0 +1,145 @@
+#include "platform.h"
+#include "profiler.h"
+
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/timer.h>
+#include <libopencm3/cm3/nvic.h>
+
+static uint32_t hist_addr[PROFILER_ENTRIES];
+static uint16_t hist_count[PROFILER_ENTRIES];
+static volatile uint32_t samples, dropped;
+
+static volatile uint32_t ring[PROFILER_RING];
+static volatile uint32_t ring_put, ring_get;
+
+void profiler_sample(const uint32_t *frame);
+
+/* the stacked PC is in the exception frame on MSP or PSP, as told by EXC_RETURN in LR.
+ * tail-calls profiler_sample() with the frame, which returns from the exception */
+void __attribute__((naked)) tim16_isr(void) {
+	__asm__ volatile(
+		"movs r0, #4		\n"
+		"mov  r1, lr		\n"
+		"tst  r0, r1		\n"
+		"beq  1f			\n"
+		"mrs  r0, psp		\n"
+		"b    2f			\n"
+		"1:					\n"
+		"mrs  r0, msp		\n"
+		"2:					\n"
+		"ldr  r1, =profiler_sample	\n"
+		"bx   r1			\n"
+		".ltorg				\n"
+	);
+}
+
+void RAMFUNC_HOT profiler_sample(const uint32_t *frame) {
+	uint32_t addr = frame[6] & ~(PROFILER_BUCKET - 1);
+	uint32_t i, slot = (addr / PROFILER_BUCKET) & (PROFILER_ENTRIES - 1);
+
+	TIM_SR(TIM16) = ~TIM_SR_UIF;
+	samples++;
+
+	/* open addressing with linear probing */
+	for(i=0; i<PROFILER_ENTRIES; i++, slot=(slot + 1) & (PROFILER_ENTRIES - 1)) {
+		if(!hist_count[slot])
+			hist_addr[slot] = addr;
+		if(hist_addr[slot] == addr) {
+			if(hist_count[slot] != UINT16_MAX)
+				hist_count[slot]++;
+			break;
+		}
+	}
+	if(i == PROFILER_ENTRIES)
+		dropped++;
+
+	/* the raw PC for streaming - the oldest samples are overwritten */
+	ring[ring_put & (PROFILER_RING - 1)] = frame[6];
+	ring_put++;
+	if((ring_put - ring_get) > PROFILER_RING)
+		ring_get = ring_put - PROFILER_RING;
+}
+
+/* 1MHz counter clock */
+static void profiler_set_prescaler(void) {
+	timer_set_prescaler(TIM16, (rcc_apb1_frequency / 1000000) - 1);
+}
+
+static clock_notifier_t profiler_clock_notifier = { .changed = profiler_set_prescaler };
+
+void profiler_init(void) {
+	rcc_periph_clock_enable(RCC_TIM16);
+	rcc_periph_reset_pulse(RST_TIM16);
+	profiler_set_prescaler();
+	clock_notifier_add(&profiler_clock_notifier);
+	timer_set_period(TIM16, (1000000 / PROFILER_HZ) - 1);
+	timer_enable_irq(TIM16, TIM_DIER_UIE);
+	nvic_set_priority(NVIC_TIM16_IRQ, 0);	/* highest priority, to sample the other ISRs as well */
+}
+
+void profiler_start(void) {
+	timer_enable_counter(TIM16);
+	nvic_enable_irq(NVIC_TIM16_IRQ);
+}
+
+void profiler_stop(void) {
+	nvic_disable_irq(NVIC_TIM16_IRQ);
+	timer_disable_counter(TIM16);
+}
+
+void profiler_clear(void) {
+	uint8_t isr_state = nvic_get_irq_enabled(NVIC_TIM16_IRQ);
+	uint32_t i;
+	nvic_disable_irq(NVIC_TIM16_IRQ);
+	for(i=0; i<PROFILER_ENTRIES; i++)
+		hist_count[i] = 0;
+	samples = 0;
+	dropped = 0;
+	ring_get = ring_put;
+	if(isr_state)
+		nvic_enable_irq(NVIC_TIM16_IRQ);
+}
+
+uint32_t profiler_samples(uint32_t *n_dropped) {
+	if(n_dropped)
+		*n_dropped = dropped;
+	return samples;
+}
+
+/* selection of the n largest - n is small and so is the histogram */
+uint32_t profiler_top(profiler_entry_t *top, uint32_t n) {
+	uint32_t found, i;
+	for(found=0; found<n; found++) {
+		uint32_t best = 0, best_count = 0;
+		for(i=0; i<PROFILER_ENTRIES; i++) {
+			uint32_t count = hist_count[i], j;
+			if(count <= best_count)
+				continue;
+			/* skip the entries already taken */
+			for(j=0; (j < found) && (top[j].addr != hist_addr[i]); j++) {}
+			if(j == found) {
+				best = i;
+				best_count = count;
+			}
+		}
+		if(!best_count)
+			break;
+		top[found].addr = hist_addr[best];
+		top[found].count = best_count;
+	}
+	return found;
+}
+
+int profiler_read(uint32_t *pc) {
+	uint8_t isr_state = nvic_get_irq_enabled(NVIC_TIM16_IRQ);
+	int res = 0;
+	nvic_disable_irq(NVIC_TIM16_IRQ);
+	if(ring_get != ring_put) {
+		*pc = ring[ring_get & (PROFILER_RING - 1)];
+		ring_get++;
+		res = 1;
+	}
+	if(isr_state)
+		nvic_enable_irq(NVIC_TIM16_IRQ);
+	return res;
+}
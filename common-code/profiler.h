@@ -0,0 +1,38 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdint.h>
+
+/* statistical PC-sampling profiler
+ *
+ * TIM16 interrupts at PROFILER_HZ with the highest priority and samples the PC stacked by the exception entry, so
+ * ISRs are profiled too. samples are counted in a small hash table keyed by PROFILER_BUCKET-aligned addresses and
+ * copied to a ring for streaming. common-code/profiler_symbols.py maps the addresses to symbols of the ELF file. */
+
+#ifndef PROFILER_HZ
+#define PROFILER_HZ			997		/* not a multiple of HZ, so it doesn't alias with the tick */
+#endif
+#ifndef PROFILER_ENTRIES
+#define PROFILER_ENTRIES	128		/* histogram size (power of 2) */
+#endif
+#define PROFILER_BUCKET		16		/* bytes of code per histogram entry (power of 2) */
+#define PROFILER_RING		64		/* raw samples buffered for streaming (power of 2) */
+
+typedef struct {
+	uint32_t addr;
+	uint32_t count;
+} profiler_entry_t;
+
+void profiler_init(void);
+void profiler_start(void);
+void profiler_stop(void);
+void profiler_clear(void);
+
+/* samples taken, and the ones which didn't fit into the histogram */
+uint32_t profiler_samples(uint32_t *dropped);
+/* fills top with the n entries with the most samples, returns how many it found */
+uint32_t profiler_top(profiler_entry_t *top, uint32_t n);
+/* pops a raw sample from the ring, returns 0 if it is empty */
+int profiler_read(uint32_t *pc);
+
+#endif /* PROFILER_H */
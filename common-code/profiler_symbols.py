@@ -0,0 +1,65 @@
+#!/usr/bin/env python3
+"""Maps the output of the "prof" console command to the symbols of the firmware (see profiler.h)
+
+Reads "prof top" lines (<hex addr> <samples> <permille>) or "prof stream" lines (<hex pc>) from a file or stdin
+and prints the samples per function, using the symbol table of the ELF file (arm-none-eabi-nm).
+
+Example:
+    echo "prof top 16" > /dev/ttyACM0; cat /dev/ttyACM0 > prof.txt
+    ./profiler_symbols.py ../ACMconsole/ACMconsole.elf prof.txt
+"""
+
+import bisect
+import collections
+import re
+import subprocess
+import sys
+
+BUCKET = 16     # PROFILER_BUCKET
+
+
+def load_symbols(elf, nm='arm-none-eabi-nm'):
+    """sorted list of (start, end, name) of the code symbols"""
+    out = subprocess.run([nm, '-n', '-S', '--defined-only', elf], capture_output=True, text=True, check=True).stdout
+    symbols = []
+    for line in out.splitlines():
+        fields = line.split()
+        if len(fields) != 4 or fields[2] not in 'tTwW':
+            continue
+        start, size = int(fields[0], 16) & ~1, int(fields[1], 16)   # clear the thumb bit
+        symbols.append((start, start + size, fields[3]))
+    return symbols
+
+
+def lookup(symbols, starts, addr):
+    i = bisect.bisect_right(starts, addr) - 1
+    if i >= 0 and symbols[i][0] <= addr < symbols[i][1]:
+        return symbols[i][2]
+    return '?%08x' % addr
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit(__doc__)
+    symbols = load_symbols(sys.argv[1])
+    starts = [s[0] for s in symbols]
+    counts = collections.Counter()
+    src = open(sys.argv[2]) if len(sys.argv) > 2 else sys.stdin
+    for line in src:
+        m = re.match(r'\s*([0-9a-fA-F]{8})(?:\s+(\d+))?', line)
+        if m:
+            addr = int(m.group(1), 16)
+            samples = int(m.group(2)) if m.group(2) else 1
+            name = lookup(symbols, starts, addr)
+            if m.group(2) and name.startswith('?'):
+                # a histogram bucket (PROFILER_BUCKET bytes) may start in the padding before a function
+                end = lookup(symbols, starts, addr + BUCKET - 1)
+                name = name if end.startswith('?') else end
+            counts[name] += samples
+    total = sum(counts.values()) or 1
+    for name, samples in counts.most_common():
+        print('%8d %5.1f%%  %s' % (samples, 100.0 * samples / total, name))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,89 @@
+#include "platform.h"
+#include "sched.h"
+
+static task_t *tasks;
+volatile uint32_t sched_events;
+
+void sched_add(task_t *task) {
+	task_t **p;
+	/* keep the order of registration - it's the order tasks run in when woken together */
+	for(p=&tasks; *p; p=&(*p)->next) {}
+	task->next = NULL;
+	*p = task;
+}
+
+void sched_wake_at(task_t *task, uint32_t deadline) {
+	task->deadline = deadline;
+	task->deadline_set = 1;
+}
+
+void sched_cancel_deadline(task_t *task) {
+	task->deadline_set = 0;
+}
+
+task_t *sched_tasks(void) {
+	return tasks;
+}
+
+/* deadlines are compared by distance, so they survive the jiffies rollover */
+static int task_deadline_passed(const task_t *t, uint32_t now) {
+	return t->deadline_set && ((int32_t)(now - t->deadline) >= 0);
+}
+
+static int task_due(const task_t *t, uint32_t events, uint32_t now) {
+	return (t->events & events) || (t->ring && *t->ring) || task_deadline_passed(t, now);
+}
+
+/* called with IRQs disabled */
+static int any_task_due(void) {
+	const task_t *t;
+	uint32_t now = jiffies, events = sched_events;
+	for(t=tasks; t; t=t->next)
+		if(task_due(t, events, now))
+			return 1;
+	return 0;
+}
+
+/* jiffies until the earliest deadline, called with IRQs disabled when no task is due */
+static uint32_t ticks_to_next_deadline(void) {
+	const task_t *t;
+	uint32_t now = jiffies, ticks = UINT32_MAX;
+	for(t=tasks; t; t=t->next)
+		if(t->deadline_set)
+			ticks = MIN(ticks, t->deadline - now);
+	return ticks;
+}
+
+static void run_task(task_t *t, uint32_t events) {
+	uint32_t start = cycles(), spent;
+	t->woken_by = t->events & events;
+	t->deadline_set &= !task_deadline_passed(t, jiffies);	/* one-shot */
+	t->run(t);
+	spent = cycles() - start;
+	t->runs++;
+	t->cycles_total += spent;
+	t->cycles_max = MAX(t->cycles_max, spent);
+}
+
+void sched_run(void) {
+	while(1) {
+		task_t *t;
+		uint32_t events, now;
+
+		/* the single idle path: sleep until an ISR or the earliest deadline makes a task due */
+		for(__disable_irq(), irq_trace_off_begin(); !any_task_due(); __disable_irq(), irq_trace_off_begin()) {
+			idle_sleep(ticks_to_next_deadline());
+			irq_trace_off_end();
+			__enable_irq();		/* run ISR */
+		}
+		events = sched_events;
+		sched_events = 0;
+		irq_trace_off_end();
+		__enable_irq();
+
+		now = jiffies;
+		for(t=tasks; t; t=t->next)
+			if(task_due(t, events, now))
+				run_task(t, events);
+	}
+}
@@ -0,0 +1,46 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdint.h>
+
+/* cooperative run-to-completion scheduler
+ *
+ * a task runs (from sched_run(), never preempted by other tasks) when one of its wake conditions is met:
+ * - one of its event bits was posted by event_post() (platform.h, e.g. from an ISR)
+ * - its deadline (absolute jiffies) has passed - one-shot, re-arm it with sched_wake_in()/sched_wake_at()
+ * - the fill counter of its ring is non-zero (e.g. &ACM_rx_fill) - set ring to NULL to stop waking on it
+ * a task may change its own conditions while it runs. when no task is due, the core sleeps (WFI). */
+
+typedef struct task_s task_t;
+
+struct task_s {
+	const char *name;
+	void (*run)(task_t *task);
+	/* wake conditions */
+	uint32_t events;
+	volatile uint32_t *ring;
+	uint32_t deadline;
+	int deadline_set;
+	/* accounting: number of runs, core clock cycles spent in them */
+	uint32_t runs;
+	uint64_t cycles_total;
+	uint32_t cycles_max;
+	/* events which woke the task (valid while it runs) */
+	uint32_t woken_by;
+	task_t *next;
+};
+
+void sched_add(task_t *task);
+/* the events posted since the scheduler last dispatched them - set by event_post() with IRQs masked */
+extern volatile uint32_t sched_events;
+void sched_wake_at(task_t *task, uint32_t deadline);
+#define sched_wake_in(task, ticks) sched_wake_at((task), jiffies + (ticks))
+void sched_cancel_deadline(task_t *task);
+
+/* iterate the registered tasks, e.g. to print the accounting */
+task_t *sched_tasks(void);
+
+/* never returns */
+void sched_run(void) __attribute__((noreturn));
+
+#endif /* SCHED_H */
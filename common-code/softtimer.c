@@ -0,0 +1,141 @@
+#include "platform.h"
+#include "sched.h"
+#include "softtimer.h"
+
+/* level n holds the timers expiring within 16^(n+1) jiffies, in the slot of their n-th hex digit.
+ * when level 0 wraps, the next slot of level 1 is cascaded down - and so on for the higher levels.
+ * timers beyond the range of the wheel (~11min) wait in the last level and are re-inserted on its cascade */
+#define WHEEL_BITS		4
+#define WHEEL_SIZE		(1 << WHEEL_BITS)
+#define WHEEL_MASK		(WHEEL_SIZE - 1)
+#define WHEEL_LEVELS	4
+#define WHEEL_SPAN		(1UL << (WHEEL_BITS * WHEEL_LEVELS))
+
+static soft_timer_t *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static uint32_t wheel_jiffies;	/* the next jiffy to process */
+static uint32_t timers_active;
+
+static void timers_task_run(task_t *task);
+static task_t timers_task = { .name = "timers", .run = timers_task_run };
+
+static void timer_link(soft_timer_t **slot, soft_timer_t *timer) {
+	timer->next = *slot;
+	if(timer->next)
+		timer->next->pprev = &timer->next;
+	timer->pprev = slot;
+	*slot = timer;
+}
+
+static void timer_unlink(soft_timer_t *timer) {
+	*timer->pprev = timer->next;
+	if(timer->next)
+		timer->next->pprev = timer->pprev;
+	timer->pprev = NULL;
+}
+
+static void wheel_insert(soft_timer_t *timer) {
+	uint32_t expires = timer->expires, delta = expires - wheel_jiffies;
+	int level;
+	if((int32_t)delta < 0) {			/* already due - process with the next jiffy */
+		expires = wheel_jiffies;
+		delta = 0;
+	}
+	else if(delta >= WHEEL_SPAN) {		/* too far out - cascaded again from the last level */
+		expires = wheel_jiffies + WHEEL_SPAN - 1;
+		delta = WHEEL_SPAN - 1;
+	}
+	for(level=0; delta >= (1UL << (WHEEL_BITS * (level + 1))); level++) {}
+	timer_link(&wheel[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK], timer);
+}
+
+/* moves the timers of the current slot of a level down, returns the slot index */
+static uint32_t cascade(int level) {
+	uint32_t index = (wheel_jiffies >> (WHEEL_BITS * level)) & WHEEL_MASK;
+	soft_timer_t *timer = wheel[level][index], *next;
+	wheel[level][index] = NULL;
+	for(; timer; timer=next) {
+		next = timer->next;
+		wheel_insert(timer);
+	}
+	return index;
+}
+
+void soft_timer_start(soft_timer_t *timer, uint32_t ticks) {
+	if(soft_timer_pending(timer))
+		soft_timer_stop(timer);
+	if(!timers_active)
+		wheel_jiffies = jiffies;	/* the wheel is empty - no need to catch up on the jiffies since it was last run */
+	timer->expires = jiffies + ticks;
+	wheel_insert(timer);
+	timers_active++;
+	if(!timers_task.deadline_set || ((int32_t)(timer->expires - timers_task.deadline) < 0))
+		sched_wake_at(&timers_task, timer->expires);
+}
+
+void soft_timer_stop(soft_timer_t *timer) {
+	if(!soft_timer_pending(timer))
+		return;
+	timer_unlink(timer);
+	timers_active--;
+}
+
+/* processes all jiffies up to now, one slot of level 0 each */
+static void timers_expire(void) {
+	while((int32_t)(jiffies - wheel_jiffies) >= 0) {
+		uint32_t index = wheel_jiffies & WHEEL_MASK;
+		soft_timer_t *list, *timer;
+		int level;
+
+		if(!index)
+			for(level=1; (level < WHEEL_LEVELS) && !cascade(level); level++) {}
+
+		/* detach the slot, callbacks may stop timers of this batch */
+		list = wheel[0][index];
+		wheel[0][index] = NULL;
+		if(list)
+			list->pprev = &list;
+		wheel_jiffies++;
+
+		while((timer = list)) {
+			timer_unlink(timer);
+			timers_active--;
+			if(timer->period) {
+				timer->expires += timer->period;
+				wheel_insert(timer);
+				timers_active++;
+			}
+			timer->callback(timer);
+		}
+	}
+}
+
+/* does the jiffy j (on a level 1 boundary) cascade any timers? level 2 and up cascade on the boundaries with index 0 */
+static int cascade_due(uint32_t j) {
+	uint32_t index = (j >> WHEEL_BITS) & WHEEL_MASK;
+	return !index || wheel[1][index];
+}
+
+/* the jiffy the timer task needs to run next: the next used slot of level 0 or the next cascade which has work */
+static uint32_t next_wakeup(void) {
+	uint32_t j = wheel_jiffies, end = j + WHEEL_SIZE;
+	for(; j != end; j++) {
+		if(!(j & WHEEL_MASK) && cascade_due(j))
+			return j;
+		if(wheel[0][j & WHEEL_MASK])
+			return j;
+	}
+	for(j = (j + WHEEL_MASK) & ~WHEEL_MASK; !cascade_due(j); j += WHEEL_SIZE) {}
+	return j;
+}
+
+static void timers_task_run(task_t *task) {
+	timers_expire();
+	if(timers_active)
+		sched_wake_at(task, next_wakeup());
+	else
+		sched_cancel_deadline(task);
+}
+
+void soft_timers_init(void) {
+	sched_add(&timers_task);
+}
@@ -0,0 +1,32 @@
+#ifndef SOFTTIMER_H
+#define SOFTTIMER_H
+
+#include <stdint.h>
+
+/* software timers on a hierarchical timing wheel (4 levels of 16 slots, like the classic Linux timer wheel)
+ *
+ * - start and stop are O(1), expiry is processed in batches per jiffy by a single scheduler task
+ * - callbacks run in that task's context (never in an ISR), they may start/stop any timer incl. their own
+ * - not to be used from ISRs - post a scheduler event instead
+ * - times are in jiffies, use MS_TO_TICKS() for milliseconds */
+
+typedef struct soft_timer_s soft_timer_t;
+
+struct soft_timer_s {
+	void (*callback)(soft_timer_t *timer);
+	uint32_t period;			/* jiffies between periodic expiries, 0 for a one-shot timer */
+	/* internal */
+	uint32_t expires;
+	soft_timer_t *next;
+	soft_timer_t **pprev;		/* NULL while not pending */
+};
+
+/* (re)starts the timer to expire in 'ticks' jiffies, then every timer->period jiffies (without drift) */
+void soft_timer_start(soft_timer_t *timer, uint32_t ticks);
+void soft_timer_stop(soft_timer_t *timer);
+#define soft_timer_pending(timer) ((timer)->pprev != NULL)
+
+/* registers the timer task with the scheduler - call before sched_run() */
+void soft_timers_init(void);
+
+#endif /* SOFTTIMER_H */
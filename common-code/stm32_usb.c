@@ -35,14 +35,35 @@
 #include "utils.h"
 #include "console.h"
 
+/* all console & handler output passes here (_write() or the NO_STDIO replacements of stdio) */
+int ACM_stdout(const void *p, size_t n) {
+#if CONSOLE_COMMAND_STATS
+	/* accounted to the running command (if any) */
+	console_count_output(n);
+#endif
+#if CONSOLE_BINARY_RPC
+	/* capture handler output into the RPC reply */
+	if(console_rpc_active()) {
+		console_write_data(p, n);
+		return n;
+	}
+#endif
+#if CONSOLE_MACHINE_MODE
+	if(console_frame_active())
+		return ACM_tx(p, n, 1 | ACM_TX_ESCAPE);
+#endif
+	return ACM_tx(p, n, 1);
+}
+
 #ifndef NO_STDIO
 #include <unistd.h>
 
 int _write(int file, char *ptr, int len);
 
 int _write(int file, char *ptr, int len) {
-	int drop = (file != STDOUT_FILENO) && (file != STDERR_FILENO);
-	return drop ? len : ACM_tx(ptr, len, 1);
+	if((file != STDOUT_FILENO) && (file != STDERR_FILENO))
+		return len;
+	return ACM_stdout(ptr, len);
 }
 #endif
 
@@ -234,6 +255,7 @@ static const char bl_string[] = "ICANHAZBOOTLOADER";
 #define  ACM_RXBUF_SZ             128
 static   uint32_t ACM_rx_put    = 0;
 volatile uint32_t ACM_rx_fill   = 0;
+static   uint32_t ACM_rx_peak   = 0;
 uint8_t  ACM_rxbuf[ACM_RXBUF_SZ];
 
 volatile uint32_t SIGINT        = 0;
@@ -254,22 +276,39 @@ static uint32_t ACM_rx_request(void) {
 /* called by user from non-ISR context */
 static void ACM_rx_free(uint32_t chunk) {
 	uint8_t isr_state = nvic_get_irq_enabled(NVIC_USB_IRQ);
+#ifdef IRQ_TRACE
+	uint16_t masked;
+#endif
 	ACM_rx_get+=chunk;
 	ACM_rx_get &= (ACM_RXBUF_SZ-1);
 	
 	nvic_disable_irq(NVIC_USB_IRQ);
+#ifdef IRQ_TRACE
+	masked = irq_trace_now();
+#endif
 	ACM_rx_fill-=chunk;
+#ifdef IRQ_TRACE
+	irq_trace_masked(IRQ_MASK_ACM_RX_FREE, masked);
+#endif
 	if(isr_state)
 		nvic_enable_irq(NVIC_USB_IRQ);
 }
 
-/* called by user from non-ISR context */
-void ACM_to_console(void) {
-	uint8_t buf[64];
-	const uint32_t chunk = MIN(ACM_rx_request(), sizeof(buf));
-	memcpy(buf, ACM_rxbuf+ACM_rx_get, chunk);
-	ACM_rx_free(chunk);
-	console_process(buf, chunk);
+/* called by user from non-ISR context, returns the number of bytes which are left to process
+ * a chunk is taken out of the buffer before the console sees it, as commands may read further input (ACM_readbyte).
+ * the rest of a chunk after a line which started a resumable command waits here until the command is done, or
+ * waits for input (console_waiting_for_input()) */
+uint32_t ACM_to_console(console_t *console) {
+	static uint8_t buf[64];
+	static uint32_t len, ofs;
+	if(ofs == len) {
+		len = MIN(ACM_rx_request(), sizeof(buf));
+		ofs = 0;
+		memcpy(buf, ACM_rxbuf+ACM_rx_get, len);
+		ACM_rx_free(len);
+	}
+	ofs += console_process(console, buf+ofs, len-ofs);
+	return len-ofs;
 }
 
 /* called by user from non-ISR context */
@@ -277,7 +316,8 @@ int ACM_readbyte(void) {
 	int res=-1;
 	if(!ACM_active)
 		goto out;
-	SLEEP_UNTIL(SIGINT || ACM_rx_request());
+	while(!(SIGINT || ACM_rx_request()))
+		wait_event(EVENT_RX | EVENT_SIGINT, DEADLINE_NEVER);
 	if(!SIGINT) {
 		res=*(ACM_rxbuf+ACM_rx_get);
 		ACM_rx_free(1);
@@ -294,7 +334,7 @@ void usb_shutdown(void) {
 }
 
 /* called by USB stack in USB ISR context */
-static void cdcacm_data_rx_cb(usbd_device *usbd_dev, uint8_t ep) {
+static void RAMFUNC_HOT cdcacm_data_rx_cb(usbd_device *usbd_dev, uint8_t ep) {
 	char buf[64], *d=buf;
 	int len;
 	if(ep != 0x01)
@@ -308,30 +348,37 @@ static void cdcacm_data_rx_cb(usbd_device *usbd_dev, uint8_t ep) {
 	}
 	len = MIN(len, (int)(ACM_RXBUF_SZ-ACM_rx_fill)); // clamp len to avoid rxbuf overruns
 	ACM_rx_fill+=len;
+	ACM_rx_peak = MAX(ACM_rx_peak, ACM_rx_fill);
+	event_post(EVENT_RX);
 	for(;len;len--,d++) {
 		rx_put(*d == '\r' ? '\n' : *d);
-		SIGINT += (*d == 0x03);
+		if(*d == 0x03) {
+			SIGINT++;
+			event_post(EVENT_SIGINT);
+		}
 	}
 }
 
 #define ACM_TXBUF_SZ          1024
 static volatile uint32_t ACM_tx_fill   = 0;
+static uint32_t ACM_tx_peak   = 0;
 static uint8_t  ACM_txbuf[ACM_TXBUF_SZ];
 
 static volatile uint32_t ACM_tx_active = 0;
 
 // called from non-ISR context only
 void ACM_waitfor_txdone(void) {
-	if(ACM_active)
-		SLEEP_UNTIL(!ACM_tx_active);
+	while(ACM_active && ACM_tx_active)
+		wait_event(EVENT_TX, DEADLINE_NEVER);
 }
 
 /* MUST be called with USB IRQ disabled */
-static void cdcacm_data_tx_cb(usbd_device *usbd_dev, uint8_t ep) {
+static void RAMFUNC_HOT cdcacm_data_tx_cb(usbd_device *usbd_dev, uint8_t ep) {
 	static uint32_t ACM_tx_get    = 0;
 	uint32_t chunk;
 	uint16_t res;
 
+	event_post(EVENT_TX);
 	if((!ACM_active) || (!ACM_tx_fill)) {
 		ACM_tx_active = 0;
 		return;
@@ -358,6 +405,9 @@ static inline void tx_put(uint8_t d) {
 int ACM_tx(const void *p, size_t n, int ascii) {
 	uint8_t isr_state = nvic_get_irq_enabled(NVIC_USB_IRQ);
 	int res;
+#ifdef IRQ_TRACE
+	uint16_t masked;
+#endif
 
 	/* drop data if USB not active */
 	if(!ACM_active)
@@ -365,16 +415,27 @@ int ACM_tx(const void *p, size_t n, int ascii) {
 
 	if(isr_state)
 		nvic_disable_irq(NVIC_USB_IRQ);
+#ifdef IRQ_TRACE
+	masked = irq_trace_now();
+#endif
 
 	if(ascii) {
 		const char *d = p, *orig = p;
 		res=0;
 		for(;(n) && ((ACM_TXBUF_SZ - ACM_tx_fill) >= 2);n--,d++,ACM_tx_fill++) {
-			if(*d == '\n') {
+			uint8_t c = *d;
+			if(c == '\n') {
 				tx_put((uint8_t)'\r');
 				ACM_tx_fill++;
 			}
-			tx_put((uint8_t)*d);
+#if CONSOLE_MACHINE_MODE
+			else if((ascii & ACM_TX_ESCAPE) && CONSOLE_FRAME_ESCAPED(c)) {
+				tx_put(CONSOLE_FRAME_ESCAPE);
+				ACM_tx_fill++;
+				c ^= CONSOLE_FRAME_ESCAPE_XOR;
+			}
+#endif
+			tx_put(c);
 		}
 		res = d - orig;
 	}
@@ -385,10 +446,14 @@ int ACM_tx(const void *p, size_t n, int ascii) {
 			tx_put(*d);
 		ACM_tx_fill += res;
 	}
+	ACM_tx_peak = MAX(ACM_tx_peak, ACM_tx_fill);
 
 	if((ACM_tx_fill) && (!ACM_tx_active))
 		cdcacm_data_tx_cb(usb_dev, 0x82); /* send 1st chunk */
 
+#ifdef IRQ_TRACE
+	irq_trace_masked(IRQ_MASK_ACM_TX, masked);
+#endif
 	if(isr_state)
 		nvic_enable_irq(NVIC_USB_IRQ);
 	return res;
@@ -407,9 +472,60 @@ static void cdcacm_set_config(usbd_device *usbd_dev, uint16_t wValue) {
 	ACM_active = 1;
 }
 
-void usb_isr(void) {
+static uint32_t usb_isr_cycles_max = 0;
+
+#ifdef IRQ_TRACE
+static uint32_t usb_sof_seen;
+static uint16_t usb_sof_entry, usb_sof_frame;
+
+/* called by usbd_poll() in USB ISR context */
+static void RAMFUNC_HOT usb_sof(void) {
+	usb_sof_seen = 1;
+}
+
+/* SOFs come every 1ms, so the ISR entered for one is late by whatever exceeds 1ms since the previous one.
+ * only consecutive frames count - the timestamps wrap after 5.46ms, e.g. during suspend */
+static uint16_t RAMFUNC_HOT usb_sof_latency(uint16_t entry) {
+	uint16_t frame = *USB_FNR_REG & USB_FNR_FN, interval, latency = IRQ_TRACE_NO_LATENCY;
+	if(!usb_sof_seen)
+		return latency;
+	usb_sof_seen = 0;
+	if(frame == ((usb_sof_frame + 1) & USB_FNR_FN)) {
+		interval = entry - usb_sof_entry;
+		latency = (interval > IRQ_TRACE_US(1000)) ? (interval - IRQ_TRACE_US(1000)) : 0;
+	}
+	usb_sof_entry = entry;
+	usb_sof_frame = frame;
+	return latency;
+}
+#endif
+
+/* usbd_poll() and the rest of the USB stack are library code and stay in flash */
+void RAMFUNC_HOT usb_isr(void) {
+	uint32_t start = stopwatch_start();
+#ifdef IRQ_TRACE
+	uint16_t entry = irq_trace_now();
+#endif
 	if(usb_dev)
 		usbd_poll(usb_dev);
+	usb_isr_cycles_max = MAX(usb_isr_cycles_max, stopwatch_cycles(start));
+#ifdef IRQ_TRACE
+	irq_trace_isr(IRQ_TRACE_USB, entry, usb_sof_latency(entry));
+#endif
+}
+
+uint32_t usb_isr_max_cycles(int reset) {
+	uint32_t res = usb_isr_cycles_max;
+	if(reset)
+		usb_isr_cycles_max = 0;
+	return res;
+}
+
+void ACM_buf_usage(mem_usage_t *rx, mem_usage_t *tx) {
+	rx->peak = ACM_rx_peak;
+	rx->size = ACM_RXBUF_SZ;
+	tx->peak = ACM_tx_peak;
+	tx->size = ACM_TXBUF_SZ;
 }
 
 void usb_setup(void) {
@@ -434,6 +550,9 @@ void usb_setup(void) {
 						sizeof(usb_strings)/sizeof(char *),
 						usbd_control_buffer, sizeof(usbd_control_buffer));
 	usbd_register_set_config_callback(usb_dev, cdcacm_set_config);
+#ifdef IRQ_TRACE
+	usbd_register_sof_callback(usb_dev, usb_sof);
+#endif
 
 	nvic_set_priority(NVIC_USB_IRQ, 255);  // lowest priority
 	nvic_enable_irq(NVIC_USB_IRQ);